@@ -0,0 +1,615 @@
+/*
+ * Compressed reading archive
+ *
+ * Block layout, after the archive_block_s header:
+ *
+ *   timestamp stream, one zigzag varint per reading; the change
+ *   in the gap between readings (the first reading's is against
+ *   t_first with a gap of 0)
+ *
+ *   reading stream, varint ops with the kind in the low 2 bits
+ *
+ *     RUN   n     the current meter's last reading, n more times
+ *     STEP  z     its digits changed by zigzag(z) counts, all else the same
+ *     FULL        mode, range, prefix, unit, dp, sign, flags (varint), digits[5]
+ *     METER m     readings that follow are from meter m
+ *
+ * Every block starts from scratch, there is no state carried
+ * between them.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+#define FL __FILE__,__LINE__
+
+enum archive_op {
+	OP_RUN,
+	OP_STEP,
+	OP_FULL,
+	OP_METER
+};
+
+static size_t put_varint( uint8_t *p, uint64_t v ) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+/*
+ * Returns false if the varint runs past end or is too long
+ *
+ */
+static bool get_varint( const uint8_t **p, const uint8_t *end, uint64_t *v ) {
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return true;
+		shift += 7;
+	}
+
+	return false;
+}
+
+static inline uint64_t zigzag( int64_t v ) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag( uint64_t v ) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Display digits as a count, -1 if they aren't all numeric
+ *
+ */
+static int32_t digits_count( const struct sample_s *s ) {
+	int32_t n = 0;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		if ((s->digits[i] < '0') || (s->digits[i] > '9')) return -1;
+		n = n * 10 + (s->digits[i] - '0');
+	}
+
+	return n;
+}
+
+static void count_digits( struct sample_s *s, int32_t n ) {
+	int i;
+
+	for (i = 4; i >= 0; i--) {
+		s->digits[i] = '0' + (n % 10);
+		n /= 10;
+	}
+}
+
+static bool same_context( const struct sample_s *a, const struct sample_s *b ) {
+	return (a->mode == b->mode) && (a->range == b->range) && (a->prefix == b->prefix) && (a->unit == b->unit)
+		&& (a->dp == b->dp) && (a->sign == b->sign) && (a->flags == b->flags);
+}
+
+/*
+ * Write out the block being built, and add it to the index
+ *
+ */
+static void archive_flush( struct archive_s *a ) {
+	struct archive_enc_s *e = a->enc;
+	const struct archive_block_s *b = &e->b;
+
+	if (e->b.count == 0) return;
+
+	if (e->run) {
+		e->val_len += put_varint(e->val + e->val_len, ((uint64_t)e->run << 2) | OP_RUN);
+		e->run = 0;
+	}
+
+	memcpy(e->b.magic, ARCHIVE_BLOCK_MAGIC, sizeof(e->b.magic));
+	e->b.ts_bytes = e->ts_len;
+	e->b.value_bytes = e->val_len;
+
+	if ((pwrite(a->fd, b, sizeof(*b), a->offset) != sizeof(*b))
+			|| (pwrite(a->fd, e->ts, e->ts_len, a->offset + sizeof(e->b)) != (ssize_t)e->ts_len)
+			|| (pwrite(a->fd, e->val, e->val_len, a->offset + sizeof(e->b) + e->ts_len) != (ssize_t)e->val_len)) {
+		fprintf(stderr,"%s:%d: Unable to write archive block (%s), %u readings lost\r\n", FL, strerror(errno), e->b.count);
+	} else {
+		if (a->blocks == a->index_size) {
+			size_t n = a->index_size ? a->index_size * 2 : 256;
+			struct archive_index_s *ix = (struct archive_index_s *)realloc(a->index, n * sizeof(struct archive_index_s));
+			if (ix) {
+				a->index = ix;
+				a->index_size = n;
+			}
+		}
+		if (a->blocks < a->index_size) {
+			a->index[a->blocks].offset = a->offset;
+			a->index[a->blocks].b = e->b;
+			a->blocks++;
+		}
+		a->offset += sizeof(e->b) + e->ts_len + e->val_len;
+	}
+
+	e->b.count = 0;
+	e->ts_len = e->val_len = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: archive_encode
+  Returns Type	: void
+  ----Parameter List
+  1. struct archive_s *a,
+  2. const struct samplelog_record_s *rec, next reading
+  ------------------
+  Exit Codes	:
+  Side Effects	: may write out a block
+  --------------------------------------------------------------------
+Comments:
+	Repeats are only counted here, the RUN op goes out when
+	something different comes along (or the block closes).
+
+\------------------------------------------------------------------*/
+static void archive_encode( struct archive_s *a, const struct samplelog_record_s *rec ) {
+	struct archive_enc_s *e = a->enc;
+	const struct sample_s *s = &rec->s;
+	struct sample_s *prev = &e->prev[s->meter];
+	int64_t delta;
+
+	if ((e->b.count >= ARCHIVE_BLOCK_SAMPLES)
+			|| (e->b.count && (rec->t_ns - e->b.t_first >= ARCHIVE_BLOCK_NS))
+			|| (e->ts_len + 10 > ARCHIVE_TS_BYTES)
+			|| (e->val_len + 40 > ARCHIVE_VALUE_BYTES)) {
+		archive_flush(a);
+	}
+
+	if (e->b.count == 0) {
+		e->b.t_first = e->prev_t = rec->t_ns;
+		e->b.min = e->b.max = NAN;
+		e->prev_delta = 0;
+		e->meter = -1;
+		e->run = 0;
+		memset(e->have_prev, 0, sizeof(e->have_prev));
+	}
+
+	delta = (int64_t)(rec->t_ns - e->prev_t);
+	e->ts_len += put_varint(e->ts + e->ts_len, zigzag(delta - e->prev_delta));
+	e->prev_t = rec->t_ns;
+	e->prev_delta = delta;
+
+	if (s->meter != e->meter) {
+		if (e->run) {
+			e->val_len += put_varint(e->val + e->val_len, ((uint64_t)e->run << 2) | OP_RUN);
+			e->run = 0;
+		}
+		e->val_len += put_varint(e->val + e->val_len, ((uint64_t)s->meter << 2) | OP_METER);
+		e->meter = s->meter;
+	}
+
+	if (e->have_prev[s->meter] && same_context(prev, s) && (memcmp(prev->digits, s->digits, sizeof(s->digits)) == 0)) {
+		e->run++;
+	} else {
+		int32_t n = digits_count(s), pn = e->have_prev[s->meter] ? digits_count(prev) : -1;
+
+		if (e->run) {
+			e->val_len += put_varint(e->val + e->val_len, ((uint64_t)e->run << 2) | OP_RUN);
+			e->run = 0;
+		}
+
+		if ((n >= 0) && (pn >= 0) && same_context(prev, s)) {
+			e->val_len += put_varint(e->val + e->val_len, (zigzag(n - pn) << 2) | OP_STEP);
+		} else {
+			uint8_t *p = e->val + e->val_len;
+
+			p += put_varint(p, OP_FULL);
+			*p++ = s->mode;
+			*p++ = s->range;
+			*p++ = s->prefix;
+			*p++ = s->unit;
+			*p++ = (uint8_t)s->dp;
+			*p++ = (uint8_t)s->sign;
+			p += put_varint(p, s->flags);
+			memcpy(p, s->digits, sizeof(s->digits));
+			p += sizeof(s->digits);
+			e->val_len = p - e->val;
+		}
+
+		sample_copy(prev, s);
+		e->have_prev[s->meter] = true;
+	}
+
+	if (isfinite(s->value)) {
+		if (isnan(e->b.min) || (s->value < e->b.min)) e->b.min = s->value;
+		if (isnan(e->b.max) || (s->value > e->b.max)) e->b.max = s->value;
+	}
+	e->b.t_last = rec->t_ns;
+	e->b.count++;
+}
+
+static void *archive_thread( void *arg ) {
+	struct archive_s *a = (struct archive_s *)arg;
+	struct samplelog_record_s rec;
+
+	while (1) {
+		bool quit = a->quit; // read before draining, so nothing queued before quit is missed
+
+		while (a->input.pop(rec)) archive_encode(a, &rec);
+		if (quit) break;
+		usleep(ARCHIVE_WAIT_MS * 1000);
+	}
+
+	return NULL;
+}
+
+/*
+ * The encoder and its buffers, on the way out or after a
+ * failed start
+ *
+ */
+static void archive_enc_free( struct archive_s *a ) {
+	if (!a->enc) return;
+
+	free(a->enc->ts);
+	free(a->enc->val);
+	free(a->enc);
+	a->enc = NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: archive_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct archive_s *a,
+  2. const char *filename, must not already exist
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: creates filename, starts the archive thread
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int archive_start( struct archive_s *a, const char *filename ) {
+	struct archive_header_s h;
+	struct timespec rt, mt;
+	int err;
+
+	a->index = NULL;
+	a->blocks = a->index_size = 0;
+	a->input_dropped = 0;
+	a->quit = false;
+
+	a->enc = (struct archive_enc_s *)calloc(1, sizeof(struct archive_enc_s));
+	if (a->enc) {
+		a->enc->ts = (uint8_t *)malloc(ARCHIVE_TS_BYTES);
+		a->enc->val = (uint8_t *)malloc(ARCHIVE_VALUE_BYTES);
+	}
+	if (!a->enc || !a->enc->ts || !a->enc->val) {
+		fprintf(stderr,"%s:%d: Unable to allocate archive buffers\r\n", FL);
+		archive_enc_free(a);
+		return -1;
+	}
+
+	a->fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (a->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create archive '%s' (%s)\r\n", FL, filename, strerror(errno));
+		archive_enc_free(a);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+	h.version = ARCHIVE_VERSION;
+	h.start_realtime_ns = (uint64_t)rt.tv_sec * 1000000000 + rt.tv_nsec;
+	h.start_mono_ns = (uint64_t)mt.tv_sec * 1000000000 + mt.tv_nsec;
+
+	if (write(a->fd, &h, sizeof(h)) != sizeof(h)) {
+		fprintf(stderr,"%s:%d: Unable to write archive '%s' (%s)\r\n", FL, filename, strerror(errno));
+		close(a->fd);
+		archive_enc_free(a);
+		return -1;
+	}
+	a->offset = sizeof(h);
+
+	err = pthread_create(&a->tid, NULL, archive_thread, a);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start archive thread (%s)\r\n", FL, strerror(err));
+		close(a->fd);
+		archive_enc_free(a);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue one reading.  Called from the acquisition thread, a
+ * ring push and nothing more.
+ *
+ */
+void archive_append( struct archive_s *a, uint64_t t_ns, const struct sample_s *s ) {
+	struct samplelog_record_s rec;
+
+	rec.t_ns = t_ns;
+	sample_copy(&rec.s, s);
+	if (!a->input.push(rec)) a->input_dropped++;
+}
+
+/*
+ * Write out whatever is left, then the index
+ *
+ */
+void archive_stop( struct archive_s *a ) {
+	struct archive_trailer_s tr;
+	size_t len;
+
+	a->quit = true;
+	pthread_join(a->tid, NULL);
+
+	archive_flush(a);
+
+	memcpy(tr.magic, ARCHIVE_INDEX_MAGIC, sizeof(tr.magic));
+	tr.index_offset = a->offset;
+	tr.blocks = a->blocks;
+	len = a->blocks * sizeof(struct archive_index_s);
+	if ((pwrite(a->fd, a->index, len, a->offset) != (ssize_t)len)
+			|| (pwrite(a->fd, &tr, sizeof(tr), a->offset + len) != sizeof(tr))) {
+		fprintf(stderr,"%s:%d: Unable to write archive index (%s)\r\n", FL, strerror(errno));
+	}
+
+	if (a->input_dropped) fprintf(stderr,"%s:%d: Archive queue overflowed, %u readings dropped\r\n", FL, a->input_dropped);
+
+	close(a->fd);
+	free(a->index);
+	archive_enc_free(a);
+}
+
+static bool block_sane( const struct archive_block_s *b ) {
+	return (memcmp(b->magic, ARCHIVE_BLOCK_MAGIC, sizeof(b->magic)) == 0) && (b->count <= ARCHIVE_BLOCK_SAMPLES)
+		&& (b->ts_bytes <= ARCHIVE_TS_BYTES) && (b->value_bytes <= ARCHIVE_VALUE_BYTES);
+}
+
+/*
+ * No usable index at the end (the writer didn't get to close
+ * the archive), so walk the block headers.  Only the headers
+ * are read, and anything after the last whole block is ignored.
+ *
+ */
+static int archive_scan( struct archive_reader_s *r, uint64_t size ) {
+	uint64_t offset = sizeof(struct archive_header_s);
+	size_t index_size = 0;
+	struct archive_block_s b;
+
+	while (offset + sizeof(b) <= size) {
+		if ((pread(r->fd, &b, sizeof(b), offset) != sizeof(b)) || !block_sane(&b)) break;
+		if (offset + sizeof(b) + b.ts_bytes + b.value_bytes > size) break;
+
+		if (r->blocks == index_size) {
+			size_t n = index_size ? index_size * 2 : 256;
+			struct archive_index_s *ix = (struct archive_index_s *)realloc(r->index, n * sizeof(struct archive_index_s));
+			if (!ix) return -1;
+			r->index = ix;
+			index_size = n;
+		}
+		r->index[r->blocks].offset = offset;
+		r->index[r->blocks].b = b;
+		r->blocks++;
+
+		offset += sizeof(b) + b.ts_bytes + b.value_bytes;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: archive_reader_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct archive_reader_s *r,
+  2. const char *filename,
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Reads the header and the block index, nothing else.
+
+\------------------------------------------------------------------*/
+int archive_reader_open( struct archive_reader_s *r, const char *filename ) {
+	struct archive_trailer_s tr;
+	struct stat st;
+	uint64_t size;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if ((r->fd < 0) || (fstat(r->fd, &st) != 0)) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, filename, strerror(errno));
+		return -1;
+	}
+	size = st.st_size;
+
+	if ((pread(r->fd, &r->h, sizeof(r->h), 0) != sizeof(r->h)) || (memcmp(r->h.magic, ARCHIVE_MAGIC, sizeof(r->h.magic)) != 0)) {
+		fprintf(stderr,"%s:%d: '%s' is not an archive\r\n", FL, filename);
+		return -1;
+	}
+	if (r->h.version != ARCHIVE_VERSION) {
+		fprintf(stderr,"%s:%d: '%s' is archive version %d, this tool reads version %d\r\n", FL, filename, r->h.version, ARCHIVE_VERSION);
+		return -1;
+	}
+
+	r->buf_size = ARCHIVE_TS_BYTES + ARCHIVE_VALUE_BYTES;
+	r->buf = (uint8_t *)malloc(r->buf_size);
+	if (!r->buf) return -1;
+
+	if ((size >= sizeof(r->h) + sizeof(tr))
+			&& (pread(r->fd, &tr, sizeof(tr), size - sizeof(tr)) == sizeof(tr))
+			&& (memcmp(tr.magic, ARCHIVE_INDEX_MAGIC, sizeof(tr.magic)) == 0)
+			&& (tr.blocks <= (size - sizeof(r->h)) / sizeof(struct archive_index_s))
+			&& (tr.index_offset + tr.blocks * sizeof(struct archive_index_s) + sizeof(tr) == size)) {
+		size_t len = tr.blocks * sizeof(struct archive_index_s);
+
+		r->index = (struct archive_index_s *)malloc(len ? len : 1);
+		if (r->index && (pread(r->fd, r->index, len, tr.index_offset) == (ssize_t)len)) {
+			r->blocks = tr.blocks;
+			return 0;
+		}
+		free(r->index);
+		r->index = NULL;
+	}
+
+	fprintf(stderr,"%s:%d: '%s' has no index, it wasn't closed properly; scanning\r\n", FL, filename);
+	return archive_scan(r, size);
+}
+
+/*
+ * Decode one block, passing the readings between from_ns and
+ * to_ns to fn.  Returns 1 if fn asked to stop, -1 if the block
+ * is corrupt.
+ *
+ */
+static int archive_read_block( struct archive_reader_s *r, const struct archive_index_s *ix, uint64_t from_ns, uint64_t to_ns, archive_read_fn fn, void *ctx ) {
+	struct sample_s prev[ARCHIVE_METERS];
+	bool have_prev[ARCHIVE_METERS] = { false };
+	const struct archive_block_s *b = &ix->b;
+	const uint8_t *tp, *tend, *vp, *vend;
+	struct samplelog_record_s rec;
+	uint64_t t = b->t_first;
+	int64_t delta = 0;
+	uint32_t done = 0;
+	int meter = -1;
+	size_t len = b->ts_bytes + b->value_bytes;
+
+	if (!block_sane(b) || (len > r->buf_size)) return -1;
+	if (pread(r->fd, r->buf, len, ix->offset + sizeof(struct archive_block_s)) != (ssize_t)len) return -1;
+
+	tp = r->buf;
+	tend = vp = r->buf + b->ts_bytes;
+	vend = r->buf + len;
+
+	while (done < b->count) {
+		uint64_t op, arg, n = 1, dod;
+
+		if (!get_varint(&vp, vend, &op)) return -1;
+		arg = op >> 2;
+
+		switch (op & 3) {
+			case OP_METER:
+				if (arg >= ARCHIVE_METERS) return -1;
+				meter = arg;
+				continue;
+
+			case OP_RUN:
+				if ((meter < 0) || !have_prev[meter] || (arg == 0) || (arg > b->count - done)) return -1;
+				n = arg;
+				break;
+
+			case OP_STEP: {
+				int64_t c;
+				if ((meter < 0) || !have_prev[meter] || (arg >> 62) || (digits_count(&prev[meter]) < 0)) return -1;
+				c = digits_count(&prev[meter]) + unzigzag(arg);
+				if ((c < 0) || (c > 99999)) return -1;
+				count_digits(&prev[meter], c);
+				sample_set_value(&prev[meter]);
+				break;
+			}
+
+			case OP_FULL: {
+				struct sample_s *s;
+				uint64_t flags;
+				if ((meter < 0) || (vend - vp < 6)) return -1;
+				s = &prev[meter];
+				s->mode = *vp++;
+				s->range = *vp++;
+				s->prefix = *vp++;
+				s->unit = *vp++;
+				s->dp = (int8_t)*vp++;
+				s->sign = (int8_t)*vp++;
+				if (!get_varint(&vp, vend, &flags) || (vend - vp < (ptrdiff_t)sizeof(s->digits))) return -1;
+				s->flags = flags;
+				memcpy(s->digits, vp, sizeof(s->digits));
+				vp += sizeof(s->digits);
+				s->meter = meter;
+				if ((s->mode >= MODE_COUNT) || (s->prefix >= PREFIX_COUNT) || (s->unit >= UNIT_COUNT) || (s->dp < -1) || (s->dp > 4)) return -1;
+				sample_set_value(s);
+				have_prev[meter] = true;
+				break;
+			}
+		}
+
+		for (; n; n--, done++) {
+			if (!get_varint(&tp, tend, &dod)) return -1;
+			delta += unzigzag(dod);
+			t += delta;
+
+			if ((t < from_ns) || (t > to_ns)) continue;
+			rec.t_ns = t;
+			rec.s = prev[meter];
+			if (fn(ctx, &rec)) return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: archive_read
+  Returns Type	: int
+  ----Parameter List
+  1. struct archive_reader_s *r,
+  2. uint64_t from_ns, to_ns, CLOCK_MONOTONIC range wanted, inclusive
+  3. archive_read_fn fn, called for each reading in the range
+  4. void *ctx, passed to fn
+  ------------------
+  Exit Codes	: 0 on success, -1 if a corrupt block was found
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Blocks wholly outside the range are skipped on the strength
+	of the index alone.  fn returning non zero stops the read.
+
+\------------------------------------------------------------------*/
+int archive_read( struct archive_reader_s *r, uint64_t from_ns, uint64_t to_ns, archive_read_fn fn, void *ctx ) {
+	size_t i;
+
+	for (i = 0; i < r->blocks; i++) {
+		const struct archive_index_s *ix = &r->index[i];
+		int result;
+
+		if ((ix->b.t_last < from_ns) || (ix->b.t_first > to_ns)) continue;
+
+		result = archive_read_block(r, ix, from_ns, to_ns, fn, ctx);
+		if (result < 0) {
+			fprintf(stderr,"%s:%d: Corrupt archive block at offset %lu\r\n", FL, (unsigned long)ix->offset);
+			return -1;
+		}
+		if (result > 0) break;
+	}
+
+	return 0;
+}
+
+void archive_reader_close( struct archive_reader_s *r ) {
+	if (r->fd >= 0) close(r->fd);
+	free(r->index);
+	free(r->buf);
+}
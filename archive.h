@@ -0,0 +1,130 @@
+/*
+ * Compressed reading archive
+ *
+ * For soak tests that run for days.  Consecutive readings are
+ * usually identical or a few counts apart, so rather than the
+ * fixed 32 byte records of the sample log (-l) the archive (-A)
+ * stores them in blocks of up to ARCHIVE_BLOCK_SAMPLES:
+ *
+ *   timestamps  delta-of-delta, zigzag varints; a steady
+ *               request rate costs a byte a reading
+ *   readings    repeats of the previous reading are run length
+ *               encoded, a change of digits alone is a zigzag
+ *               varint of the change in counts, anything else
+ *               (mode, range, flags) is written out in full
+ *
+ * Each block starts with a header giving its time span, min/max
+ * value and size, and decodes on its own.  Closing the archive
+ * appends an index of the block headers, so a reader can find a
+ * time range without decompressing anything else; if the writer
+ * never got to close it the reader walks the block headers
+ * instead.
+ *
+ * The acquisition thread only queues readings, encoding and file
+ * writes happen on the archive's own thread.
+ *
+ */
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "samplelog.h"
+#include "spsc.h"
+
+#define ARCHIVE_MAGIC "VC8145AR"
+#define ARCHIVE_BLOCK_MAGIC "VCAB"
+#define ARCHIVE_INDEX_MAGIC "VC8145IX"
+#define ARCHIVE_VERSION 1
+
+#define ARCHIVE_BLOCK_SAMPLES 4096
+#define ARCHIVE_BLOCK_NS (60ULL * 1000000000) // close a block after a minute regardless, bounds what a crash loses
+#define ARCHIVE_TS_BYTES (ARCHIVE_BLOCK_SAMPLES * 10)    // worst case varints
+#define ARCHIVE_VALUE_BYTES (ARCHIVE_BLOCK_SAMPLES * 32)
+#define ARCHIVE_METERS 256 // sample_s.meter is a uint8_t
+#define ARCHIVE_QUEUE 4096 // acquisition -> archive thread, must be a power of two
+#define ARCHIVE_WAIT_MS 10
+
+struct archive_header_s {
+	char magic[8];
+	uint16_t version;
+	uint16_t reserved[3];
+	uint64_t start_realtime_ns; // as samplelog_header_s, so times
+	uint64_t start_mono_ns;     // convert the same way
+	uint8_t pad[32];
+};
+
+struct archive_block_s {
+	char magic[4];
+	uint32_t count;       // readings
+	uint32_t ts_bytes;    // timestamp stream, then
+	uint32_t value_bytes; // reading stream, follow the header
+	uint64_t t_first, t_last; // CLOCK_MONOTONIC ns
+	double min, max;      // finite values only, NaN if there were none
+};
+
+struct archive_index_s {
+	uint64_t offset; // of the block header
+	struct archive_block_s b;
+};
+
+struct archive_trailer_s {
+	char magic[8];
+	uint64_t index_offset;
+	uint64_t blocks;
+};
+
+/*
+ * Encoder state, archive thread only
+ */
+struct archive_enc_s {
+	struct archive_block_s b;
+	uint8_t *ts, *val;
+	size_t ts_len, val_len;
+	uint64_t prev_t;
+	int64_t prev_delta;
+	int meter;    // whose reading the value stream is on
+	uint32_t run; // repeats not yet written
+	struct sample_s prev[ARCHIVE_METERS];
+	bool have_prev[ARCHIVE_METERS];
+};
+
+struct archive_s {
+	int fd;
+	uint64_t offset; // next block goes here
+	struct archive_enc_s *enc;
+
+	struct archive_index_s *index;
+	size_t blocks, index_size;
+
+	spsc_ring<struct samplelog_record_s, ARCHIVE_QUEUE> input;
+	uint32_t input_dropped; // acquisition side only
+
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+struct archive_reader_s {
+	int fd;
+	struct archive_header_s h;
+	struct archive_index_s *index;
+	size_t blocks;
+	uint8_t *buf;
+	size_t buf_size;
+};
+
+typedef int (*archive_read_fn)( void *ctx, const struct samplelog_record_s *rec );
+
+int archive_start( struct archive_s *a, const char *filename );
+void archive_append( struct archive_s *a, uint64_t t_ns, const struct sample_s *s );
+void archive_stop( struct archive_s *a );
+
+int archive_reader_open( struct archive_reader_s *r, const char *filename );
+int archive_read( struct archive_reader_s *r, uint64_t from_ns, uint64_t to_ns, archive_read_fn fn, void *ctx );
+void archive_reader_close( struct archive_reader_s *r );
+
+#endif
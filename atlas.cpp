@@ -0,0 +1,244 @@
+/*
+ * Glyph atlas
+ *
+ * Covers printable ASCII plus the handful of non-ASCII symbols
+ * the decoder produces (micro, degree, ohm).  Anything else is
+ * drawn as a blank of the same width as a space.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "atlas.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * UTF-8 of the extra glyphs, stored after the ASCII range
+ */
+static const char *extra_glyphs[ATLAS_EXTRA_GLYPHS] = {
+	"\u00B5",
+	"\u00B0",
+	"\u03A9"
+};
+
+static const uint32_t extra_codepoints[ATLAS_EXTRA_GLYPHS] = {
+	0x00B5,
+	0x00B0,
+	0x03A9
+};
+
+/*
+ * Decode one UTF-8 character from *p and advance past it.
+ * Only as much of UTF-8 as we need: 1, 2 and 3 byte forms.
+ *
+ */
+static uint32_t utf8_next( const char **p ) {
+	const uint8_t *s = (const uint8_t *)*p;
+	uint32_t c = s[0];
+
+	if (c < 0x80) {
+		*p += 1;
+	} else if (((c & 0xE0) == 0xC0) && s[1]) {
+		c = ((c & 0x1F) << 6) | (s[1] & 0x3F);
+		*p += 2;
+	} else if (((c & 0xF0) == 0xE0) && s[1] && s[2]) {
+		c = ((c & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+		*p += 3;
+	} else {
+		c = ' ';
+		*p += 1;
+	}
+
+	return c;
+}
+
+/*
+ * Codepoint to slot in the atlas, unknown characters
+ * map to the space.
+ *
+ */
+static int glyph_index( uint32_t c ) {
+	int i;
+
+	if (c >= ATLAS_ASCII_FIRST && c <= ATLAS_ASCII_LAST) return c - ATLAS_ASCII_FIRST;
+	for (i = 0; i < ATLAS_EXTRA_GLYPHS; i++) {
+		if (extra_codepoints[i] == c) return ATLAS_ASCII_LAST - ATLAS_ASCII_FIRST +1 +i;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: atlas_build
+  Returns Type	: int
+  ----Parameter List
+  1. struct atlas_s *a,
+  2. SDL_Renderer *renderer,
+  3. TTF_Font *font,
+  4. SDL_Color color,
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: creates a->texture
+  --------------------------------------------------------------------
+Comments:
+	Glyphs are packed left to right in rows no wider than
+	ATLAS_MAX_WIDTH, all rows being one font height tall.
+
+\------------------------------------------------------------------*/
+int atlas_build( struct atlas_s *a, SDL_Renderer *renderer, TTF_Font *font, SDL_Color color ) {
+	SDL_Surface *glyph_surface[ATLAS_GLYPHS];
+	SDL_Surface *sheet;
+	int x = 0, rows = 1;
+	int i;
+
+	memset(a, 0, sizeof(struct atlas_s));
+	a->height = TTF_FontHeight(font);
+
+	for (i = 0; i < ATLAS_GLYPHS; i++) {
+		char str[8];
+
+		if (i <= ATLAS_ASCII_LAST - ATLAS_ASCII_FIRST) {
+			str[0] = ATLAS_ASCII_FIRST +i;
+			str[1] = '\0';
+		} else {
+			snprintf(str, sizeof(str), "%s", extra_glyphs[i - (ATLAS_ASCII_LAST - ATLAS_ASCII_FIRST +1)]);
+		}
+
+		glyph_surface[i] = TTF_RenderUTF8_Blended(font, str, color);
+		if (!glyph_surface[i]) {
+			fprintf(stderr,"%s:%d: Unable to render glyph '%s' (%s)\r\n", FL, str, SDL_GetError());
+			while (i--) SDL_FreeSurface(glyph_surface[i]);
+			return -1;
+		}
+
+		if (x + glyph_surface[i]->w > ATLAS_MAX_WIDTH) {
+			x = 0;
+			rows++;
+		}
+		a->glyphs[i].src = { x, (rows -1) * a->height, glyph_surface[i]->w, glyph_surface[i]->h };
+		x += glyph_surface[i]->w;
+	}
+
+	sheet = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_MAX_WIDTH, rows * a->height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (sheet) {
+		for (i = 0; i < ATLAS_GLYPHS; i++) {
+			SDL_Rect dst = a->glyphs[i].src;
+			SDL_SetSurfaceBlendMode(glyph_surface[i], SDL_BLENDMODE_NONE);
+			SDL_BlitSurface(glyph_surface[i], NULL, sheet, &dst);
+		}
+		a->texture = SDL_CreateTextureFromSurface(renderer, sheet);
+		SDL_FreeSurface(sheet);
+	}
+
+	for (i = 0; i < ATLAS_GLYPHS; i++) SDL_FreeSurface(glyph_surface[i]);
+
+	if (!a->texture) {
+		fprintf(stderr,"%s:%d: Unable to create glyph atlas (%s)\r\n", FL, SDL_GetError());
+		return -1;
+	}
+	SDL_SetTextureBlendMode(a->texture, SDL_BLENDMODE_BLEND);
+
+	return 0;
+}
+
+void atlas_free( struct atlas_s *a ) {
+	if (a->texture) SDL_DestroyTexture(a->texture);
+	a->texture = NULL;
+}
+
+/*
+ * Width in pixels that text would occupy
+ *
+ */
+int atlas_text_width( struct atlas_s *a, const char *text ) {
+	int w = 0;
+
+	while (*text) w += a->glyphs[glyph_index(utf8_next(&text))].src.w;
+
+	return w;
+}
+
+/*
+ * Draw text with its top-left at x,y.  Returns the
+ * width drawn.
+ *
+ */
+int atlas_draw( struct atlas_s *a, SDL_Renderer *renderer, const char *text, int x, int y ) {
+	int x0 = x;
+
+	while (*text) {
+		struct glyph_s *gl = &(a->glyphs[glyph_index(utf8_next(&text))]);
+		SDL_Rect dst = { x, y, gl->src.w, gl->src.h };
+
+		SDL_RenderCopy(renderer, a->texture, &gl->src, &dst);
+		x += gl->src.w;
+	}
+
+	return x - x0;
+}
+
+void atlas_cache_init( struct atlas_cache_s *c, const char *font_file, SDL_Color color ) {
+	memset(c, 0, sizeof(struct atlas_cache_s));
+	c->font_file = font_file;
+	c->color = color;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: atlas_cache_get
+  Returns Type	: struct atlas_s *
+  ----Parameter List
+  1. struct atlas_cache_s *c,
+  2. SDL_Renderer *renderer,
+  3. int size, font size in pt
+  ------------------
+  Exit Codes	: the atlas, or NULL if the font couldn't be rasterised
+  Side Effects	: may build an atlas, and free the least recently used
+  --------------------------------------------------------------------
+Comments:
+	The pointer is good until ATLAS_CACHE_SIZE other sizes
+	have been asked for.
+
+\------------------------------------------------------------------*/
+struct atlas_s *atlas_cache_get( struct atlas_cache_s *c, SDL_Renderer *renderer, int size ) {
+	struct atlas_cache_entry_s *e, *victim = &(c->entries[0]);
+	TTF_Font *font;
+	int i;
+
+	c->clock++;
+
+	for (i = 0; i < ATLAS_CACHE_SIZE; i++) {
+		e = &(c->entries[i]);
+		if (e->size == size) {
+			e->used = c->clock;
+			return &(e->atlas);
+		}
+		if (e->used < victim->used) victim = e;
+	}
+
+	font = TTF_OpenFont(c->font_file, size);
+	if (!font) {
+		fprintf(stderr,"%s:%d: Unable to open font '%s' at %dpt (%s)\r\n", FL, c->font_file, size, SDL_GetError());
+		return NULL;
+	}
+
+	if (victim->size) atlas_free(&(victim->atlas));
+	victim->size = 0;
+	if (atlas_build(&(victim->atlas), renderer, font, c->color) == 0) {
+		victim->size = size;
+		victim->used = c->clock;
+	}
+	TTF_CloseFont(font);
+
+	return victim->size ? &(victim->atlas) : NULL;
+}
+
+void atlas_cache_free( struct atlas_cache_s *c ) {
+	int i;
+
+	for (i = 0; i < ATLAS_CACHE_SIZE; i++) {
+		if (c->entries[i].size) atlas_free(&(c->entries[i].atlas));
+		c->entries[i].size = 0;
+	}
+}
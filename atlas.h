@@ -0,0 +1,59 @@
+/*
+ * Glyph atlas
+ *
+ * Every character we ever draw is rasterised once, in to a
+ * single texture, when the atlas is built.  Drawing a line of
+ * text is then just a run of SDL_RenderCopy()s out of that
+ * texture, no TTF work or texture uploads per reading.
+ *
+ * The cache keeps atlases for the last few font sizes asked for,
+ * built the first time each size is wanted, so resizing the
+ * window back and forth only ever rasterises a size once.
+ *
+ */
+#ifndef __ATLAS_H__
+#define __ATLAS_H__
+
+#include <SDL.h>
+#include <SDL_ttf.h>
+
+#define ATLAS_MAX_WIDTH 2048
+#define ATLAS_ASCII_FIRST 0x20
+#define ATLAS_ASCII_LAST 0x7E
+#define ATLAS_EXTRA_GLYPHS 3 // micro, degree, ohm
+#define ATLAS_GLYPHS (ATLAS_ASCII_LAST - ATLAS_ASCII_FIRST +1 + ATLAS_EXTRA_GLYPHS)
+#define ATLAS_CACHE_SIZE 8 // font sizes kept, least recently used goes first
+
+struct glyph_s {
+	SDL_Rect src; // location in the atlas texture
+};
+
+struct atlas_s {
+	SDL_Texture *texture;
+	int height;  // line height, all glyphs share it
+	struct glyph_s glyphs[ATLAS_GLYPHS];
+};
+
+struct atlas_cache_entry_s {
+	int size;      // pt, 0 = unused
+	uint64_t used; // cache clock when last asked for
+	struct atlas_s atlas;
+};
+
+struct atlas_cache_s {
+	const char *font_file;
+	SDL_Color color;
+	uint64_t clock;
+	struct atlas_cache_entry_s entries[ATLAS_CACHE_SIZE];
+};
+
+int atlas_build( struct atlas_s *a, SDL_Renderer *renderer, TTF_Font *font, SDL_Color color );
+void atlas_free( struct atlas_s *a );
+int atlas_text_width( struct atlas_s *a, const char *text );
+int atlas_draw( struct atlas_s *a, SDL_Renderer *renderer, const char *text, int x, int y );
+
+void atlas_cache_init( struct atlas_cache_s *c, const char *font_file, SDL_Color color );
+struct atlas_s *atlas_cache_get( struct atlas_cache_s *c, SDL_Renderer *renderer, int size );
+void atlas_cache_free( struct atlas_cache_s *c );
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Serial capture file format
+ *
+ * A record of the raw bytes that went over the wire in each
+ * direction, with the time they were seen.  Written when a
+ * capture is dumped, read back by the replay device.
+ *
+ *   capture_header_s
+ *   { capture_chunk_s, data[len] } ...
+ *
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "VC8145CP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_DIR_TX 0 // host to meter
+#define CAPTURE_DIR_RX 1 // meter to host
+
+struct capture_header_s {
+	char magic[8];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t baud;
+	uint64_t start_realtime_ns;
+	uint64_t start_mono_ns;
+};
+
+struct __attribute__ ((packed)) capture_chunk_s {
+	uint64_t t_ns; // CLOCK_MONOTONIC
+	uint8_t dir;   // CAPTURE_DIR_*
+	uint8_t len;   // bytes of data following
+};
+
+#endif
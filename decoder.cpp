@@ -0,0 +1,337 @@
+/*
+ * VICI VC8145 frame decoder
+ *
+ * While the data sheet gives a very nice matrix for the RANGE and
+ * FUNCTION values, here it is flattened in to two lookup tables;
+ * one indexed by the function bits of byte 1, the other by mode
+ * and the range bits of byte 2.
+ *
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decoder.h"
+
+#define uu "\u00B5"
+#define dd "\u00B0"
+#define oo "\u03A9"
+
+static const char SEPARATOR_DP[] = ".";
+
+/*
+ * Function bits (byte 1, bits 7:3) to mode
+ *
+ */
+static constexpr uint8_t function_table[32] = {
+	MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN,
+	MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN,
+	MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN, MODE_UNKNOWN,
+	MODE_GENERATOR,   // 0xA0
+	MODE_CURRENT_A,   // 0xA8
+	MODE_CURRENT_MA,  // 0xB0
+	MODE_UNKNOWN,     // 0xB8
+	MODE_TEMPERATURE, // 0xC0
+	MODE_CAPACITANCE, // 0xC8
+	MODE_FREQUENCY,   // 0xD0
+	MODE_DIODE,       // 0xD8
+	MODE_RESISTANCE,  // 0xE0
+	MODE_MV,          // 0xE8
+	MODE_VDC,         // 0xF0
+	MODE_VAC          // 0xF8
+};
+
+/*
+ * Per mode constants
+ *
+ * unit_exp is the power of ten between what the meter shows
+ * and the base unit (mV, mA).  The separator strings are used
+ * in place of the normal ones with -u.
+ *
+ */
+struct mode_info_s {
+	const char *name;
+	uint8_t unit;
+	int8_t unit_exp;
+	const char *units;
+	const char *units_sep;
+};
+
+static const struct mode_info_s mode_table[MODE_COUNT] = {
+	{ "***",         UNIT_NONE,  0, "*",     "*" },
+	{ "Generator",   UNIT_NONE,  0, "",      "" },
+	{ "Frequency",   UNIT_HZ,    0, "Hz",    "Hz" },
+	{ "Capacitance", UNIT_FARAD, 0, "F",     "F" },
+	{ "Temperature", UNIT_DEGC,  0, dd "C",  dd "C" },
+	{ "Diode",       UNIT_VOLT,  0, "V",     "v" },
+	{ "Resistance",  UNIT_OHM,   0, oo,      "" },
+	{ "Current",     UNIT_AMP,   0, "A",     "A" },
+	{ "Current",     UNIT_AMP,  -3, "mA",    "mA" },
+	{ "Volts (mV)",  UNIT_VOLT, -3, "mV",    "mV" },
+	{ "VAC",         UNIT_VOLT,  0, "V",     "v" },
+	{ "VDC",         UNIT_VOLT,  0, "V",     "v" }
+};
+
+static const char *unit_names[UNIT_COUNT] = { "", "Hz", "F", dd "C", "V", oo, "A" };
+
+struct prefix_info_s {
+	int8_t exp;
+	const char *str;
+	const char *str_sep;
+};
+
+static const struct prefix_info_s prefix_table[PREFIX_COUNT] = {
+	{  0, " ", "" },
+	{  0, " ", oo },
+	{ -9, "n", "n" },
+	{ -6, uu,  uu },
+	{  3, "k", "k" },
+	{  6, "M", "M" }
+};
+
+/*
+ * Mode and range (byte 2, bits 5:3) to decimal point position
+ * and prefix.  dp is the display digit the point follows, -1
+ * for no point at all.
+ *
+ */
+struct range_info_s {
+	int8_t dp;
+	uint8_t prefix;
+};
+
+#define R(dp,pfx) { dp, PREFIX_##pfx }
+
+static constexpr struct range_info_s range_table[MODE_COUNT][8] = {
+	/* UNKNOWN */     { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* GENERATOR */   { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* FREQUENCY */   { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* CAPACITANCE */ { R(0,NANO), R(1,NANO), R(2,NANO), R(0,MICRO), R(1,MICRO), R(2,MICRO), R(-1,NANO), R(-1,NANO) },
+	/* TEMPERATURE */ { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* DIODE */       { R(0,NONE), R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE) },
+	/* RESISTANCE */  { R(2,OHM), R(0,KILO), R(1,KILO), R(2,KILO), R(0,MEGA), R(1,MEGA), R(-1,KILO), R(-1,KILO) },
+	/* CURRENT_A */   { R(0,NONE), R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE) },
+	/* CURRENT_MA */  { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* MV */          { R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(0,NONE), R(0,NONE) },
+	/* VAC */         { R(0,NONE), R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE) },
+	/* VDC */         { R(0,NONE), R(1,NONE), R(2,NONE), R(3,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE), R(-1,NONE) }
+};
+
+#undef R
+
+static constexpr double p10( int e ) {
+	return (e == 0) ? 1.0 : (e > 0) ? 10.0 * p10(e -1) : p10(e +1) / 10.0;
+}
+
+/*
+ * Multiplier from the 5 digit integer on the display to the
+ * base unit, for every exponent a mode/range/prefix can produce
+ *
+ */
+#define SCALE_MIN_EXP -16
+static constexpr double scale_table[] = {
+	p10(-16), p10(-15), p10(-14), p10(-13), p10(-12), p10(-11), p10(-10), p10(-9),
+	p10(-8), p10(-7), p10(-6), p10(-5), p10(-4), p10(-3), p10(-2), p10(-1),
+	p10(0), p10(1), p10(2), p10(3), p10(4), p10(5), p10(6)
+};
+
+/*
+ * Display digit for a raw byte; 0x3E is the meter's 'L'
+ * (overload) and 0x3F a blanked digit.
+ *
+ */
+static inline char digit( uint8_t dg ) {
+	if (dg >= 0x30 && dg <= 0x39) return dg;
+	if (dg == 0x3E) return 'L';
+	return ' ';
+}
+
+/*
+ * Sanity check a candidate frame before believing it; right
+ * header and terminator, a function we know, a sign nibble the
+ * meter actually sends and display bytes that are characters.
+ * Binary junk on a noisy line almost never passes all of these.
+ *
+ */
+bool frame_valid( const uint8_t *d ) {
+	int i;
+
+	if ((d[0] != DATA_FRAME_HEADER) || (d[DATA_FRAME_SIZE -1] != DATA_FRAME_TERMINATOR)) return false;
+	if (function_table[d[1] >> 3] == MODE_UNKNOWN) return false;
+
+	switch (d[4] & 0b01110000) {
+		case 0:
+		case 0x40:
+		case 0x50: break;
+		default: return false;
+	}
+
+	for (i = 5; i < 10; i++) {
+		if ((d[i] < 0x20) || (d[i] > 0x3F)) return false;
+	}
+
+	return true;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: decode_frame
+  Returns Type	: int
+  ----Parameter List
+  1. const uint8_t *d, DATA_FRAME_SIZE bytes from the meter
+  2. struct sample_s *s, decoded result
+  ------------------
+  Exit Codes	: 0 on success, -1 if d is not a display data frame
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	byte 1 bits 7:3  function
+	byte 2 bits 5:3  range, bit 6 autorange
+	byte 4 bits 6:4  sign
+	bytes 5..9       display digits, ASCII
+
+\------------------------------------------------------------------*/
+int decode_frame( const uint8_t *d, struct sample_s *s ) {
+	const struct range_info_s *ri;
+	int i;
+
+	if (d[0] != DATA_FRAME_HEADER) return -1;
+
+	s->mode = function_table[d[1] >> 3];
+	s->range = (d[2] >> 3) & 0x07;
+	s->unit = mode_table[s->mode].unit;
+
+	ri = &range_table[s->mode][s->range];
+	s->dp = ri->dp;
+	s->prefix = ri->prefix;
+
+	s->flags = (d[2] & MMFLAG_AUTORANGE) ? SAMPLE_FLAG_AUTORANGE : 0;
+
+	switch (d[4] & 0b01110000) {
+		case 0:
+		case 0x40: s->sign = 1; break;
+		case 0x50: s->sign = -1; break;
+		default: s->sign = 0;
+	}
+
+	for (i = 0; i < 5; i++) {
+		char c = digit(d[5 +i]);
+		s->digits[i] = c;
+		if (c == 'L') s->flags |= SAMPLE_FLAG_OVERLOAD;
+	}
+
+	sample_set_value(s);
+
+	return 0;
+}
+
+/*
+ * Work out sample_s.value from the digits, decimal point, mode,
+ * prefix and sign, exactly as decode_frame() does; for anything
+ * that rebuilds samples without the original frame.
+ *
+ */
+void sample_set_value( struct sample_s *s ) {
+	int32_t n = 0;
+	int i, e;
+
+	if (s->flags & SAMPLE_FLAG_OVERLOAD) {
+		s->value = (s->sign < 0) ? -INFINITY : INFINITY;
+		return;
+	}
+
+	for (i = 0; i < 5; i++) {
+		char c = s->digits[i];
+		n = n * 10 + ((c >= '0' && c <= '9') ? c - '0' : 0);
+	}
+
+	e = mode_table[s->mode].unit_exp + prefix_table[s->prefix].exp - ((s->dp < 0) ? 0 : 4 - s->dp);
+	s->value = n * scale_table[e - SCALE_MIN_EXP];
+	if (s->sign < 0) s->value = -s->value;
+}
+
+/*
+ * Copy a sample field by field on to a zeroed one, so the struct
+ * padding is always zeros; anything written out, to a file or a
+ * client, is built this way rather than with a struct copy.
+ *
+ */
+void sample_copy( struct sample_s *dst, const struct sample_s *src ) {
+	memset(dst, 0, sizeof(struct sample_s));
+	dst->value = src->value;
+	dst->flags = src->flags;
+	dst->mode = src->mode;
+	dst->unit = src->unit;
+	dst->prefix = src->prefix;
+	dst->range = src->range;
+	dst->sign = src->sign;
+	dst->dp = src->dp;
+	memcpy(dst->digits, src->digits, sizeof(dst->digits));
+	dst->meter = src->meter;
+}
+
+/*
+ * Build the display text for a sample, eg "-1.2345 V"
+ *
+ * With units_separator the prefix and units replace the
+ * decimal point ( 8.09k becomes 8k09 ) and leading zeros
+ * are blanked.
+ *
+ * Returns the length of the text.
+ *
+ */
+int sample_format( const struct sample_s *s, int units_separator, char *buf, size_t len ) {
+	const struct mode_info_s *mi = &mode_table[s->mode];
+	const struct prefix_info_s *pi = &prefix_table[s->prefix];
+	char local_separator[16];
+	const char *separator = SEPARATOR_DP;
+	char sign_char;
+	int r;
+
+	switch (s->sign) {
+		case 1: sign_char = ' '; break;
+		case -1: sign_char = '-'; break;
+		default: sign_char = '*';
+	}
+
+	if (units_separator) {
+		snprintf(local_separator, sizeof(local_separator), "%s%s", pi->str_sep, mi->units_sep);
+		separator = local_separator;
+	}
+
+	r = snprintf(buf, len, "%c%c%s%c%s%c%s%c%s%c%s%s"
+			,sign_char
+			,s->digits[0]
+			,s->dp==0?separator:""
+			,s->digits[1]
+			,s->dp==1?separator:""
+			,s->digits[2]
+			,s->dp==2?separator:""
+			,s->digits[3]
+			,s->dp==3?separator:""
+			,s->digits[4]
+			,units_separator?"":pi->str
+			,units_separator?"":mi->units
+			);
+
+	if (units_separator && len > 1) {
+		char *p = buf+1; // skip the sign char
+		while (*p == '0') { *p = ' '; p++; }
+		if (!isdigit((unsigned char)*p)) *(p-1) = '0';
+	}
+
+	return r;
+}
+
+const char *sample_mode_name( const struct sample_s *s ) {
+	return mode_table[s->mode].name;
+}
+
+/*
+ * Name of the base unit sample_s.value is in
+ *
+ */
+const char *sample_unit_name( const struct sample_s *s ) {
+	return unit_names[s->unit];
+}
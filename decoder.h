@@ -0,0 +1,93 @@
+/*
+ * VICI VC8145 frame decoder
+ *
+ * Turns the 12 byte reply to an 0x89 request in to a
+ * compact sample_s.  Decoding is pure and table driven,
+ * no strings are built until something asks to display
+ * a sample via sample_format().
+ *
+ */
+#ifndef __DECODER_H__
+#define __DECODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DATA_FRAME_SIZE 12
+#define DATA_FRAME_HEADER 0x89
+#define DATA_FRAME_TERMINATOR 0x0A
+
+#define MMFLAG_AUTORANGE	0b01000000
+
+/*
+ * Meter function, from bits 7:3 of byte 1
+ */
+enum mm_mode {
+	MODE_UNKNOWN = 0,
+	MODE_GENERATOR,
+	MODE_FREQUENCY,
+	MODE_CAPACITANCE,
+	MODE_TEMPERATURE,
+	MODE_DIODE,
+	MODE_RESISTANCE,
+	MODE_CURRENT_A,
+	MODE_CURRENT_MA,
+	MODE_MV,
+	MODE_VAC,
+	MODE_VDC,
+	MODE_COUNT
+};
+
+/*
+ * Base unit of sample_s.value
+ */
+enum mm_unit {
+	UNIT_NONE = 0,
+	UNIT_HZ,
+	UNIT_FARAD,
+	UNIT_DEGC,
+	UNIT_VOLT,
+	UNIT_OHM,
+	UNIT_AMP,
+	UNIT_COUNT
+};
+
+/*
+ * Display prefix, chosen by mode and range
+ */
+enum mm_prefix {
+	PREFIX_NONE = 0,
+	PREFIX_OHM, // blank, but shows as the ohm symbol with -u
+	PREFIX_NANO,
+	PREFIX_MICRO,
+	PREFIX_KILO,
+	PREFIX_MEGA,
+	PREFIX_COUNT
+};
+
+#define SAMPLE_FLAG_AUTORANGE	0x0001
+#define SAMPLE_FLAG_OVERLOAD	0x0002 // meter showed 'L'
+#define SAMPLE_FLAG_STALE	0x0004 // no good reply, this repeats the last reading
+
+struct sample_s {
+	double value;    // scaled to the base unit, sign applied
+	uint16_t flags;  // SAMPLE_FLAG_*
+	uint8_t mode;    // enum mm_mode
+	uint8_t unit;    // enum mm_unit
+	uint8_t prefix;  // enum mm_prefix
+	uint8_t range;   // raw range bits 5:3 of byte 2
+	int8_t sign;     // 1, -1, or 0 if the meter sent something unexpected
+	int8_t dp;       // digit the decimal point follows, -1 for none
+	char digits[5];  // display digits, '0'-'9', 'L' or ' '
+	uint8_t meter;   // which meter, in -p order; not set by decode_frame()
+};
+
+bool frame_valid( const uint8_t *d );
+int decode_frame( const uint8_t *d, struct sample_s *s );
+void sample_set_value( struct sample_s *s );
+void sample_copy( struct sample_s *dst, const struct sample_s *src );
+int sample_format( const struct sample_s *s, int units_separator, char *buf, size_t len );
+const char *sample_mode_name( const struct sample_s *s );
+const char *sample_unit_name( const struct sample_s *s );
+
+#endif
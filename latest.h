@@ -0,0 +1,52 @@
+/*
+ * Latest value slot
+ *
+ * A single writer publishes values, any number of readers pick
+ * up whichever was published last.  Older values are simply
+ * overwritten, which is exactly what a consumer that only ever
+ * wants "now" needs.  Sequence locked, so the writer never waits
+ * and a reader retries if it catches a store half way through.
+ *
+ */
+#ifndef __LATEST_H__
+#define __LATEST_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+template <typename T>
+struct latest_slot {
+	std::atomic<uint32_t> seq{0}; // odd while a store is in progress
+	T value;
+
+	void store( const T &v ) {
+		uint32_t s = seq.load(std::memory_order_relaxed);
+
+		seq.store(s +1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy((void *)&value, &v, sizeof(T));
+		seq.store(s +2, std::memory_order_release);
+	}
+
+	/*
+	 * Copy out the current value and the sequence it was
+	 * published under.  Returns false if nothing has been
+	 * published yet.
+	 */
+	bool load( T &v, uint32_t &version ) {
+		uint32_t s1, s2;
+
+		do {
+			s1 = seq.load(std::memory_order_acquire);
+			memcpy(&v, (const void *)&value, sizeof(T));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			s2 = seq.load(std::memory_order_relaxed);
+		} while ((s1 & 1) || (s1 != s2));
+
+		version = s1;
+		return (s1 != 0);
+	}
+};
+
+#endif
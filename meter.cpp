@@ -0,0 +1,652 @@
+/*
+ * Meter acquisition
+ *
+ * One meter's worth of serial handling, written so that many
+ * meters can be run from a single event loop.  Each call does
+ * whatever can be done right now and returns; waiting is the
+ * caller's job.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "meter.h"
+#include "stats.h"
+#include "trace.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Milliseconds on the monotonic clock, used for timeouts
+ *
+ */
+int64_t mono_ms( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Microseconds on the monotonic clock
+ *
+ */
+int64_t mono_us( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Nanoseconds on the monotonic clock, sample timestamps.
+ * Every meter is stamped from this one clock so readings
+ * from different meters can be lined up.
+ *
+ */
+uint64_t mono_ns( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Set up the scheduler for a given rate, 0 meaning
+ * run flat out.
+ *
+ */
+static void sched_init( struct sched_s *s, double rate ) {
+	s->interval_us = (rate > 0) ? (int64_t)(1000000.0 / rate) : 0;
+	s->next_us = mono_us();
+	s->window_start_us = s->next_us;
+	s->window_count = 0;
+	s->achieved_rate = 0;
+}
+
+/*
+ * How many milliseconds until the next request is due,
+ * 0 if it can be sent now.
+ *
+ */
+static int sched_wait_ms( struct sched_s *s ) {
+	int64_t wait = s->next_us - mono_us();
+
+	if (wait <= 0) return 0;
+	return (int)((wait +999) / 1000);
+}
+
+/*
+ * Account for a validated reading and work out when the
+ * next request may go.  If we've fallen behind the target
+ * we just carry on from now rather than bursting to catch up.
+ *
+ */
+static void sched_sample( struct sched_s *s ) {
+	int64_t now = mono_us();
+
+	s->next_us += s->interval_us;
+	if (s->next_us < now) s->next_us = now;
+
+	s->window_count++;
+	if (now - s->window_start_us >= SCHED_RATE_WINDOW) {
+		s->achieved_rate = s->window_count * 1000000.0 / (now - s->window_start_us);
+		s->window_start_us = now;
+		s->window_count = 0;
+	}
+}
+
+/*
+ *
+ * Open serial port for communitcations
+ *
+ */
+static int open_port( struct serial_params_s *s ) {
+	int r;
+
+	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
+	if (s->fd <0) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, s->device, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Non-blocking; all waiting is done by the caller's
+	 * event loop so that a silent meter can never hang it.
+	 */
+	fcntl(s->fd,F_SETFL,O_NONBLOCK);
+
+	s->ring.head = s->ring.tail = 0;
+
+	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings
+	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
+	cfmakeraw(&(s->newtp));
+	s->newtp.c_cflag = B9600 | CS8 | CLOCAL | CREAD; // Adjust the settings to suit our meter
+	s->newtp.c_cflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
+	s->newtp.c_cflag &= ~(PARENB | PARODD); // shut off parity
+	s->newtp.c_cflag &= ~CSTOPB;
+	s->newtp.c_cflag &= ~CRTSCTS;
+
+	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
+	if (r) {
+		fprintf(stderr,"%s:%d: Error setting terminal (%s)\r\n", FL, strerror(errno));
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Low latency mode, -L
+ *
+ * USB serial adapters (FTDI especially) hold received bytes
+ * for up to 16ms hoping for more; ASYNC_LOW_LATENCY asks the
+ * driver to pass them up straight away.  Not every port
+ * supports it, which is worth a mention but not fatal.
+ *
+ */
+static void port_low_latency( struct meter_s *m ) {
+	struct serial_struct ss;
+
+	if (ioctl(m->serial_params.fd, TIOCGSERIAL, &ss) < 0) {
+		fprintf(stderr,"%s:%d: %s: can't read serial settings, low latency not set (%s)\r\n", FL, m->device, strerror(errno));
+		return;
+	}
+
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(m->serial_params.fd, TIOCSSERIAL, &ss) < 0) {
+		fprintf(stderr,"%s:%d: %s: unable to set low latency (%s)\r\n", FL, m->device, strerror(errno));
+	}
+}
+
+/*
+ * With VTIME 0 the tty only reports the port readable once
+ * VMIN bytes are waiting, so in low latency mode we're woken
+ * once per whole data frame instead of once per byte or two.
+ * Range control echoes are single bytes and drop it back to 1.
+ *
+ * Reads stay non-blocking and take whatever is there, so a
+ * short reply is still picked up when its timeout comes round.
+ *
+ */
+static void port_set_vmin( struct meter_s *m, int vmin ) {
+	struct serial_params_s *s = &(m->serial_params);
+
+	if (!m->low_latency || (m->vmin == vmin)) return;
+
+	s->newtp.c_cc[VMIN] = vmin;
+	s->newtp.c_cc[VTIME] = 0;
+	if (tcsetattr(s->fd, TCSANOW, &(s->newtp))) {
+		fprintf(stderr,"%s:%d: %s: Error setting VMIN (%s)\r\n", FL, m->device, strerror(errno));
+		m->low_latency = 0;
+		return;
+	}
+	m->vmin = vmin;
+}
+
+/*
+ * Send single byte command to the meter
+ *
+ */
+static size_t cmd_send( struct meter_s *m, uint8_t cmd ) {
+	ssize_t bytes_written;
+
+	bytes_written = write(m->serial_params.fd, &cmd, 1);
+	if (bytes_written < 0) return 0;
+	wire_add(&m->wire, CAPTURE_DIR_TX, &cmd, 1);
+	if (m->debug) trace_bytes(TRACE_TX, m->index, &cmd, 1);
+
+	return bytes_written;
+}
+
+/*
+ * Pull the next good frame out of the ring.
+ *
+ * Incremental; skip to an 0x89, wait until a whole frame's worth
+ * of bytes follow it, and if they don't check out (no 0x0A in the
+ * right place, fields out of range) step past that 0x89 and look
+ * for the next one.  Whatever noise the link throws at us we pick
+ * up the next good frame in the stream without asking again.
+ *
+ * Returns 1 with the frame in frame[], 0 if there isn't a good
+ * one yet.
+ *
+ */
+static int frame_parse( struct meter_s *m, uint8_t *frame ) {
+	struct serial_ring_s *r = &(m->serial_params.ring);
+	size_t skipped = 0;
+	int found = 0;
+
+	while (r->head != r->tail) {
+		size_t i;
+
+		if (r->buf[r->tail & (SERIAL_RING_SIZE -1)] != DATA_FRAME_HEADER) {
+			r->tail++;
+			skipped++;
+			continue;
+		}
+
+		if (r->head - r->tail < DATA_FRAME_SIZE) break;
+
+		for (i = 0; i < DATA_FRAME_SIZE; i++) frame[i] = r->buf[(r->tail +i) & (SERIAL_RING_SIZE -1)];
+
+		if (frame_valid(frame)) {
+			r->tail += DATA_FRAME_SIZE;
+			found = 1;
+			break;
+		}
+
+		stats_count(COUNT_FRAME_ERRORS, 1);
+		wire_error(&m->wire);
+		r->tail++;
+		skipped++;
+	}
+
+	if (skipped) {
+		stats_count(COUNT_RESYNCS, 1);
+		if (m->debug) trace_values(TRACE_RESYNC, m->index, skipped, 0);
+	}
+
+	return found;
+}
+
+/*
+ * Throw away whatever is in the ring; with no request in flight
+ * it can only be a late reply or noise, and must not be taken
+ * for the answer to the next one
+ *
+ */
+static void meter_discard( struct meter_s *m ) {
+	struct serial_ring_s *r = &(m->serial_params.ring);
+	size_t skipped = r->head - r->tail;
+
+	if (!skipped) return;
+
+	r->tail = r->head;
+	stats_count(COUNT_RESYNCS, 1);
+	if (m->debug) trace_values(TRACE_RESYNC, m->index, skipped, 0);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: meter_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct meter_s *m, device, index etc already filled in
+  2. double rate, readings per second, 0 = max rate
+  ------------------
+  Exit Codes	: 0 on success, -1 if the port couldn't be set up
+  Side Effects	: starts the simulator for sim/replay devices
+  --------------------------------------------------------------------
+Comments:
+	A simulated meter sits on the far side of a pty, from
+	here on it looks just like the real thing.
+
+\------------------------------------------------------------------*/
+int meter_open( struct meter_s *m, double rate ) {
+	m->sim_running = false;
+	m->serial_params.device = m->device;
+
+	if (sim_is_device(m->device)) {
+		if (sim_start(&m->sim, m->device)) return -1;
+		m->serial_params.device = m->sim.slave_name;
+		m->sim_running = true;
+	}
+
+	if (open_port(&m->serial_params)) {
+		if (m->sim_running) sim_stop(&m->sim);
+		m->sim_running = false;
+		return -1;
+	}
+
+	if (wire_open(&m->wire, m->index)) {
+		close(m->serial_params.fd);
+		m->serial_params.fd = -1;
+		if (m->sim_running) sim_stop(&m->sim);
+		m->sim_running = false;
+		return -1;
+	}
+
+	m->vmin = 1; // as left by cfmakeraw()
+	if (m->low_latency) port_low_latency(m);
+
+	sched_init(&m->sched, rate);
+	m->state = METER_IDLE;
+	m->deadline_ms = 0;
+	m->hold_ms = 0;
+	m->cmds.head = m->cmds.tail = 0;
+	m->rx_ns = m->tx_ns = m->first_ns = 0;
+	m->last_loaded = false;
+	m->readings_dropped = 0;
+
+	return 0;
+}
+
+void meter_close( struct meter_s *m ) {
+	if (m->serial_params.fd >= 0) close(m->serial_params.fd);
+	m->serial_params.fd = -1;
+	if (m->sim_running) sim_stop(&m->sim);
+	m->sim_running = false;
+	wire_close(&m->wire);
+}
+
+/*
+ * How long the event loop may sleep before this meter
+ * needs servicing again, ignoring serial input.
+ *
+ */
+int meter_timeout_ms( struct meter_s *m ) {
+	int64_t wait;
+
+	if (m->state == METER_IDLE) {
+		wait = m->hold_ms - mono_ms();
+		if (wait > 0) return (int)wait;
+		if (m->cmds.head != m->cmds.tail) return 0;
+		return sched_wait_ms(&m->sched);
+	}
+
+	wait = m->deadline_ms - mono_ms();
+	if (wait <= 0) return 0;
+	return (int)wait;
+}
+
+/*
+ * Read everything the port has in to the ring in as few
+ * read() calls as possible.  The free space may wrap around
+ * the end of the buffer, so at most two passes.
+ *
+ * Returns the number of bytes added, -1 on a port error.
+ *
+ * While idle nothing is waiting on the ring, so it's emptied
+ * first; the port is always read dry and a full ring can't
+ * leave epoll spinning on it.
+ *
+ */
+ssize_t meter_drain( struct meter_s *m ) {
+	struct serial_ring_s *r = &(m->serial_params.ring);
+	ssize_t total = 0;
+
+	if (m->state == METER_IDLE) meter_discard(m);
+
+	while (r->head - r->tail < SERIAL_RING_SIZE) {
+		size_t offset = r->head & (SERIAL_RING_SIZE -1);
+		size_t space = SERIAL_RING_SIZE - (r->head - r->tail);
+		size_t run = SERIAL_RING_SIZE - offset;
+		ssize_t n;
+
+		if (run > space) run = space;
+		n = read(m->serial_params.fd, r->buf +offset, run);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR)) break;
+			return -1;
+		}
+		if (n == 0) break;
+		wire_add(&m->wire, CAPTURE_DIR_RX, r->buf +offset, n);
+		if (m->debug) trace_bytes(TRACE_RX, m->index, r->buf +offset, n);
+
+		r->head += n;
+		total += n;
+		if ((size_t)n < run) break;
+	}
+
+	if (total) {
+		m->rx_ns = mono_ns();
+		if ((m->state == METER_AWAIT_FRAME) && !m->first_ns) m->first_ns = m->rx_ns;
+	}
+
+	return total;
+}
+
+/*
+ * Add a command to the back of the queue, acquisition
+ * thread only.  Returns 0 if the queue is full.
+ *
+ */
+static int meter_queue_cmd( struct meter_s *m, uint8_t cmd, int pause_ms ) {
+	struct meter_cmd_queue_s *cq = &(m->cmds);
+	struct meter_cmd_s *c;
+
+	if (cq->head - cq->tail == METER_CMD_QUEUE) return 0;
+
+	c = &(cq->q[cq->head & (METER_CMD_QUEUE -1)]);
+	c->cmd = cmd;
+	c->tries = 0;
+	c->pause_ms = pause_ms;
+	cq->head++;
+
+	return 1;
+}
+
+/*
+ * Queue a command from another thread (the UI).  It goes out
+ * between readings the next time the meter is idle; the result
+ * only shows up in the readings that follow, and in the stats.
+ *
+ * Returns 0 if too many commands are already waiting.
+ *
+ */
+int meter_command( struct meter_s *m, uint8_t cmd, int pause_ms ) {
+	struct meter_cmd_s c;
+
+	c.cmd = cmd;
+	c.tries = 0;
+	c.pause_ms = pause_ms;
+
+	return m->ui_cmds.push(c) ? 1 : 0;
+}
+
+/*
+ * Send the command at the front of the queue and wait for
+ * its echo
+ *
+ */
+static void meter_cmd_send( struct meter_s *m ) {
+	struct meter_cmd_s *c = &(m->cmds.q[m->cmds.tail & (METER_CMD_QUEUE -1)]);
+
+	if (c->tries) stats_count(COUNT_COMMAND_RETRIES, 1);
+	c->tries++;
+
+	port_set_vmin(m, 1);
+	cmd_send(m, c->cmd);
+	m->state = METER_AWAIT_ACK;
+	m->deadline_ms = mono_ms() + METER_CMD_ACK_MS;
+}
+
+/*
+ * Look for the echo of the command in progress.  Anything
+ * ahead of it is left over from before and thrown away.
+ *
+ * Returns true once the command is finished with, acknowledged
+ * or not.
+ *
+ */
+static bool meter_cmd_ack( struct meter_s *m ) {
+	struct serial_ring_s *r = &(m->serial_params.ring);
+	struct meter_cmd_s *c = &(m->cmds.q[m->cmds.tail & (METER_CMD_QUEUE -1)]);
+
+	while (r->head != r->tail) {
+		if (r->buf[(r->tail++) & (SERIAL_RING_SIZE -1)] == c->cmd) {
+			stats_count(COUNT_COMMANDS, 1);
+			m->hold_ms = mono_ms() + c->pause_ms;
+			m->cmds.tail++;
+			return true;
+		}
+	}
+
+	if (mono_ms() < m->deadline_ms) return false;
+
+	if (c->tries < METER_CMD_TRIES) {
+		meter_cmd_send(m);
+		return false;
+	}
+
+	if (m->debug) trace_values(TRACE_CMD_FAILED, m->index, c->cmd, 0);
+	stats_count(COUNT_COMMAND_FAILURES, 1);
+	m->cmds.tail++;
+	return true;
+}
+
+/*
+ * Send 0x89 and start waiting for the reply.  Anything already
+ * read, or still sat in the port, predates it and is dropped.
+ *
+ * Returns 0 if the request couldn't be written.
+ *
+ */
+static int meter_request( struct meter_s *m ) {
+	meter_drain(m); // a port error turns up again on the next epoll wake
+	meter_discard(m);
+
+	port_set_vmin(m, DATA_FRAME_SIZE);
+	if (cmd_send(m, 0x89) == 0) return 0;
+
+	m->tx_ns = mono_ns();
+	m->first_ns = 0;
+	m->state = METER_AWAIT_FRAME;
+	m->deadline_ms = mono_ms() + SERIAL_TIMEOUT_MS;
+
+	return 1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: meter_service
+  Returns Type	: int
+  ----Parameter List
+  1. struct meter_s *m,
+  2. struct reading_s *r, decoded reading when we return 1
+  ------------------
+  Exit Codes	: 1 if r holds a new reading, 0 if there's nothing to do until
+                  more input arrives or meter_timeout_ms() passes
+  Side Effects	: sends requests / range commands to the meter
+  --------------------------------------------------------------------
+Comments:
+	Request 0x89, which returns the main display data and
+	includes the device state in bytes [1:3], byte 4 contains
+	sign/range/hold.
+
+	Requests are pipelined; the meter is free again the moment
+	its 0x0A arrives, so if the scheduler allows the next 0x89
+	goes straight out and this frame is decoded, logged and
+	drawn while the meter builds the next one.  Range control
+	has to see the decoded frame before anything else is sent,
+	so it does without.
+
+	Queued commands take priority over the next request, but
+	never interrupt one that's in flight.
+
+	If no good frame turns up in time, r is the last good
+	sample again with SAMPLE_FLAG_STALE set, so the display
+	can say so; stale readings are never logged or published.
+
+\------------------------------------------------------------------*/
+int meter_service( struct meter_s *m, struct reading_s *r ) {
+	uint8_t d[DATA_FRAME_SIZE];
+
+	while (1) {
+		switch (m->state) {
+
+			case METER_IDLE:
+				{
+					struct meter_cmd_s c;
+					while ((m->cmds.head - m->cmds.tail < METER_CMD_QUEUE) && m->ui_cmds.pop(c)) {
+						meter_queue_cmd(m, c.cmd, c.pause_ms);
+					}
+				}
+				if (mono_ms() < m->hold_ms) return 0;
+				if (m->cmds.head != m->cmds.tail) {
+					meter_cmd_send(m);
+					break;
+				}
+				if (sched_wait_ms(&m->sched)) return 0;
+				if (!meter_request(m)) return 0;
+				break;
+
+			case METER_AWAIT_FRAME:
+				if (!frame_parse(m, d)) {
+					/*
+					 * Nothing good back from the meter, go
+					 * round again and ask once more; unless
+					 * VMIN was holding back a short reply.
+					 */
+					if (mono_ms() < m->deadline_ms) return 0;
+					if (m->low_latency && (meter_drain(m) > 0)) break;
+					stats_count(COUNT_TIMEOUTS, 1);
+					wire_error(&m->wire); // a short reply or none at all
+					m->state = METER_IDLE;
+					if (!m->last_loaded) break;
+
+					r->s = m->last;
+					r->s.flags |= SAMPLE_FLAG_STALE;
+					r->rate = m->sched.achieved_rate;
+					r->tx_ns = m->tx_ns;
+					r->first_ns = r->last_ns = 0;
+					return 1;
+				}
+				m->state = METER_IDLE;
+
+				if (m->debug) trace_bytes(TRACE_FRAME, m->index, d, DATA_FRAME_SIZE);
+
+				stats_count(COUNT_FRAMES, 1);
+				/*
+				 * Not when the reply was already in the ring
+				 * before the request went, see TRACE_REPLY below
+				 */
+				if (m->rx_ns >= m->tx_ns) stats_record(STAGE_REPLY, m->rx_ns - m->tx_ns);
+				sched_sample(&m->sched);
+
+				r->tx_ns = m->tx_ns;
+				r->first_ns = m->first_ns;
+				r->last_ns = m->rx_ns;
+
+				if (!m->range_control && (m->cmds.head == m->cmds.tail) && (sched_wait_ms(&m->sched) == 0)) meter_request(m);
+
+				{
+					uint64_t t0 = mono_ns();
+					decode_frame(d, &r->s);
+					stats_record(STAGE_DECODE, mono_ns() - t0);
+				}
+				r->s.meter = m->index;
+				r->rate = m->sched.achieved_rate;
+
+				m->last = r->s;
+				m->last_loaded = true;
+
+				if (m->debug) {
+					trace_values(TRACE_RANGE, m->index, r->s.range, (int64_t)r->s.dp);
+					/*
+					 * The reply may have been in the ring before
+					 * the request was stamped, or not timed at all
+					 */
+					trace_values(TRACE_REPLY, m->index
+							, (r->first_ns >= r->tx_ns) ? r->first_ns - r->tx_ns : 0
+							, (r->last_ns >= r->tx_ns) ? r->last_ns - r->tx_ns : 0
+							);
+				}
+
+				/*
+				 * Range control (-r); two presses of RANGE take
+				 * an autoranging VDC reading out of autorange.
+				 */
+				if (m->range_control && (r->s.mode == MODE_VDC) && (r->s.flags & SAMPLE_FLAG_AUTORANGE) && (m->cmds.head == m->cmds.tail)) {
+					meter_queue_cmd(m, METER_CMD_RANGE, RANGE_PAUSE_MS);
+					meter_queue_cmd(m, METER_CMD_RANGE, 0);
+				}
+
+				return 1;
+
+			case METER_AWAIT_ACK:
+				if (!meter_cmd_ack(m)) return 0;
+				m->state = METER_IDLE;
+				break;
+		}
+	}
+}
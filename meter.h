@@ -0,0 +1,162 @@
+/*
+ * Meter acquisition
+ *
+ * Everything to do with talking to one VC8145: the serial port,
+ * the request scheduler and a small state machine that asks for
+ * a reading, collects the reply and works through any queued
+ * commands (range control etc).
+ *
+ * Nothing in here ever blocks.  The caller owns the event loop;
+ * it waits for the port to become readable (or for the time given
+ * by meter_timeout_ms()), calls meter_drain() and then
+ * meter_service() until it stops handing back readings.  That
+ * way any number of meters can share one thread.
+ *
+ */
+#ifndef __METER_H__
+#define __METER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "decoder.h"
+#include "runstats.h"
+#include "simulator.h"
+#include "spsc.h"
+#include "wire.h"
+
+#define METER_MAX 8 // -p devices per process
+
+#define SCHED_IDLE_MS 20 // longest nap while waiting for the next request slot
+#define SCHED_RATE_WINDOW 1000000 // achieved rate is measured over 1 second
+
+#define READING_QUEUE_SIZE 64 // must be a power of two
+
+#define SERIAL_RING_SIZE 256 // must be a power of two
+#define SERIAL_TIMEOUT_MS 500 // give up on a reply after 0.5 seconds
+
+#define METER_CMD_RANGE 0xA1 // as if the RANGE button was pressed
+#define METER_CMD_QUEUE 8 // must be a power of two
+#define METER_CMD_ACK_MS 200 // wait this long for a command to be echoed,
+#define METER_CMD_TRIES 3    // and send it this many times before giving up
+#define RANGE_PAUSE_MS 100 // between the two 0xA1 range commands
+
+/*
+ * Receive ring, filled in bulk from the serial port and
+ * drained a frame at a time.  head/tail run freely and are
+ * masked on access, so head - tail is always the fill level.
+ */
+struct serial_ring_s {
+	uint8_t buf[SERIAL_RING_SIZE];
+	size_t head, tail;
+};
+
+struct serial_params_s {
+	char *device;
+	int fd, n;
+	int cnt, size, s_cnt;
+	struct termios oldtp, newtp;
+	struct serial_ring_s ring;
+};
+
+/*
+ * Acquisition scheduler.
+ *
+ * Decides when the next 0x89 request may go out.  With an
+ * interval of 0 a request is sent as soon as the previous
+ * reply has been validated, otherwise requests are spaced
+ * to hold the requested rate.
+ */
+struct sched_s {
+	int64_t interval_us; // 0 = as fast as the meter allows
+	int64_t next_us;     // earliest time the next request may be sent
+	int64_t window_start_us;
+	uint32_t window_count;
+	double achieved_rate; // readings per second over the last window
+};
+
+/*
+ * Decoded reading as handed from the acquisition
+ * thread to the display
+ */
+struct reading_s {
+	struct sample_s s;
+	double rate;
+
+	uint64_t tx_ns;    // CLOCK_MONOTONIC; 0x89 written,
+	uint64_t first_ns; // first bytes of the reply read,
+	uint64_t last_ns;  // and the bytes holding the 0x0A read
+
+	struct runstats_s rs; // -a, as of this reading
+};
+
+enum meter_state {
+	METER_IDLE,        // waiting on the scheduler for the next request
+	METER_AWAIT_FRAME, // 0x89 sent, collecting the reply
+	METER_AWAIT_ACK    // command sent, waiting for the meter to echo it
+};
+
+/*
+ * A single byte command for the meter, beyond the regular
+ * 0x89 requests.  The meter echoes each one back; nothing
+ * else is sent until that echo arrives (or we give up on
+ * it) and then pause_ms more has passed.
+ */
+struct meter_cmd_s {
+	uint8_t cmd;
+	uint8_t tries; // sends so far
+	uint16_t pause_ms;
+};
+
+struct meter_cmd_queue_s {
+	struct meter_cmd_s q[METER_CMD_QUEUE];
+	size_t head, tail; // free running, masked on access
+};
+
+struct meter_s {
+	int index; // position on the command line, goes in every sample
+	char *device;
+	int debug;
+	int range_control;
+	int low_latency; // ASYNC_LOW_LATENCY and VMIN wakeups, see open_port()
+
+	struct serial_params_s serial_params;
+	struct sched_s sched;
+
+	struct sim_s sim;
+	bool sim_running;
+
+	int state;          // enum meter_state
+	int64_t deadline_ms; // reply / acknowledgement timeout
+	int64_t hold_ms;     // nothing more is sent before this, after a command
+	uint64_t rx_ns;     // CLOCK_MONOTONIC when bytes last arrived
+	uint64_t tx_ns;     // when the current request went out
+	uint64_t first_ns;  // when the first bytes of its reply arrived, 0 = none yet
+	int vmin;           // VMIN currently set on the port
+
+	struct sample_s last; // last good reading, repeated as stale when a reply fails
+	bool last_loaded;     // set when we have our first valid data
+
+	struct meter_cmd_queue_s cmds; // acquisition thread only, cmds.q[tail] is in progress
+	spsc_ring<struct meter_cmd_s, METER_CMD_QUEUE> ui_cmds; // UI -> acquisition, see meter_command()
+
+	struct runstats_s runstats; // -a, acquisition thread only
+	struct wire_s wire;         // every byte in and out, see wire.h
+
+	spsc_ring<struct reading_s, READING_QUEUE_SIZE> readings; // acquisition -> UI
+	uint32_t readings_dropped; // only touched by the acquisition thread
+};
+
+int64_t mono_ms( void );
+int64_t mono_us( void );
+uint64_t mono_ns( void );
+
+int meter_open( struct meter_s *m, double rate );
+void meter_close( struct meter_s *m );
+int meter_timeout_ms( struct meter_s *m );
+ssize_t meter_drain( struct meter_s *m );
+int meter_service( struct meter_s *m, struct reading_s *r );
+int meter_command( struct meter_s *m, uint8_t cmd, int pause_ms );
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * FlexBV output file
+ *
+ * Rather than stat() the output file on every reading we watch
+ * its directory with inotify and only act when FlexBV removes
+ * it.  The value is written in to a private file whose descriptor
+ * stays open for the life of the program, and hard linked in to
+ * place, so a reader only ever sees a complete value.  On
+ * filesystems without hard links we fall back to rename().
+ *
+ * Readings are coalesced; whatever was published most recently
+ * when FlexBV asks is what it gets.  If there's nothing new yet
+ * the thread sleeps on an eventfd until output_publish() has
+ * something.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Wait up to timeout_ms for directory events, returns true if
+ * any of them say our output file has gone away.
+ *
+ * Without inotify we just sleep and then look for the file.
+ *
+ */
+static bool output_wait_removed( struct output_s *o, int timeout_ms ) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd;
+	bool removed = false;
+	ssize_t n;
+
+	if (o->inotify_fd < 0) {
+		struct stat st;
+		usleep(timeout_ms * 1000);
+		return (stat(o->filename, &st) != 0);
+	}
+
+	pfd.fd = o->inotify_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+	while ((n = read(o->inotify_fd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + n) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->len && (strcmp(ev->name, o->basename) == 0)) removed = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return removed;
+}
+
+/*
+ * FlexBV is waiting and we've nothing new; sleep until
+ * output_publish() kicks us, or it's time to look at quit
+ * and the stats again.
+ *
+ */
+static void output_wait_sample( struct output_s *o ) {
+	struct pollfd pfd;
+	uint64_t count;
+
+	pfd.fd = o->event_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, OUTPUT_IDLE_MS) <= 0) return;
+
+	if (read(o->event_fd, &count, sizeof(count)) < 0) { /* nothing pending is fine */ }
+}
+
+/*
+ * (Re)create our private file, making sure we never reuse
+ * an inode that's still linked as the output file.
+ *
+ */
+static int output_open_tmp( struct output_s *o ) {
+	unlink(o->tfn);
+	o->tmp_fd = open(o->tfn, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (o->tmp_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create '%s' (%s)\r\n", FL, o->tfn, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Put one value in front of FlexBV
+ *
+ */
+static void output_write( struct output_s *o, const struct sample_s *s ) {
+	char value[128];
+	int len;
+
+	len = sample_format(s, o->units_separator, value, sizeof(value));
+	if (len >= (int)sizeof(value)) len = sizeof(value) -1;
+
+	/*
+	 * If FlexBV moved the file away rather than deleting it, our
+	 * inode is still in use over there; start a fresh one.
+	 */
+	if (o->tmp_fd >= 0) {
+		struct stat st;
+		if ((fstat(o->tmp_fd, &st) == 0) && (st.st_nlink > 1)) {
+			close(o->tmp_fd);
+			o->tmp_fd = -1;
+		}
+	}
+	if (o->tmp_fd < 0 && output_open_tmp(o)) return;
+
+	if ((ftruncate(o->tmp_fd, 0) != 0) || (pwrite(o->tmp_fd, value, len, 0) != len)) {
+		fprintf(stderr,"%s:%d: Unable to write '%s' (%s)\r\n", FL, o->tfn, strerror(errno));
+		return;
+	}
+
+	if (o->use_link) {
+		if (link(o->tfn, o->filename) == 0 || errno == EEXIST) {
+			o->present = true;
+		} else if (errno == EPERM || errno == EOPNOTSUPP || errno == EMLINK) {
+			o->use_link = false;
+		} else {
+			fprintf(stderr,"%s:%d: Unable to link '%s' (%s)\r\n", FL, o->filename, strerror(errno));
+			return;
+		}
+	}
+
+	/*
+	 * No hard links here, the renamed file takes our descriptor's
+	 * inode with it so we need a fresh one for next time.
+	 */
+	if (!o->use_link) {
+		if (rename(o->tfn, o->filename) != 0) {
+			fprintf(stderr,"%s:%d: Unable to rename '%s' (%s)\r\n", FL, o->tfn, strerror(errno));
+			return;
+		}
+		close(o->tmp_fd);
+		o->tmp_fd = -1;
+		o->present = true;
+	}
+
+	if (o->debug) trace_bytes(TRACE_OUTPUT, -1, value, len);
+}
+
+/*
+ * Running statistics to go with the value, written aside and
+ * renamed in to place like any other atomic file update.
+ *
+ */
+static void output_write_stats( struct output_s *o ) {
+	struct runstats_s rs;
+	char text[512];
+	uint32_t seq;
+	uint64_t now_ns;
+	int len, fd, i;
+
+	if (!o->sfn[0]) return;
+
+	now_ns = stats_now_ns();
+	if (now_ns - o->stats_written_ns < (uint64_t)OUTPUT_STATS_MS * 1000000) return;
+
+	if (!o->stats.load(rs, seq) || (seq == o->stats_written_seq)) return;
+	o->stats_written_seq = seq;
+	o->stats_written_ns = now_ns;
+
+	len = snprintf(text, sizeof(text), "n=%llu overloads=%llu min=%.6g max=%.6g mean=%.6g sd=%.6g",
+			(unsigned long long)rs.n, (unsigned long long)rs.overloads, rs.min, rs.max, rs.mean, runstats_stddev(&rs));
+	for (i = 0; (i < rs.ewma_count) && (len < (int)sizeof(text)); i++) {
+		len += snprintf(text + len, sizeof(text) - len, " ewma%gs=%.6g", rs.tau[i], rs.ewma[i]);
+	}
+	if (rs.ewma_count && (len < (int)sizeof(text))) {
+		len += snprintf(text + len, sizeof(text) - len, " slope=%.6g", rs.slope);
+	}
+	if (len < (int)sizeof(text)) len += snprintf(text + len, sizeof(text) - len, "\n");
+	if (len >= (int)sizeof(text)) len = sizeof(text) -1;
+
+	fd = open(o->sfn_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create '%s' (%s)\r\n", FL, o->sfn_tmp, strerror(errno));
+		return;
+	}
+	if (write(fd, text, len) != len) {
+		fprintf(stderr,"%s:%d: Unable to write '%s' (%s)\r\n", FL, o->sfn_tmp, strerror(errno));
+	}
+	close(fd);
+
+	if (rename(o->sfn_tmp, o->sfn) != 0) {
+		fprintf(stderr,"%s:%d: Unable to rename '%s' (%s)\r\n", FL, o->sfn_tmp, strerror(errno));
+	}
+}
+
+static void *output_thread( void *arg ) {
+	struct output_s *o = (struct output_s *)arg;
+
+	while (!o->quit) {
+		struct sample_s s;
+		uint32_t seq;
+
+		output_write_stats(o);
+
+		/*
+		 * FlexBV hasn't collected the last one yet
+		 */
+		if (o->present) {
+			if (output_wait_removed(o, OUTPUT_IDLE_MS)) o->present = false;
+			continue;
+		}
+
+		/*
+		 * FlexBV is waiting, give it the newest reading as soon
+		 * as there is one it hasn't already had.  waiting goes
+		 * up before we look, so a reading published after the
+		 * look always kicks the eventfd.
+		 */
+		o->waiting = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!o->latest.load(s, seq) || (seq == o->written_seq)) {
+			output_wait_sample(o);
+			continue;
+		}
+		o->waiting = false;
+
+		{
+			uint64_t t0 = stats_now_ns();
+			output_write(o, &s);
+			stats_record(STAGE_OUTPUT, stats_now_ns() - t0);
+		}
+		o->written_seq = seq;
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: output_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct output_s *o,
+  2. const char *filename, file FlexBV reads
+  3. int units_separator, format as per -u
+  4. int debug,
+  5. bool with_stats, also keep <filename>.stats up to date (-a)
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: starts the output thread
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int output_start( struct output_s *o, const char *filename, int units_separator, int debug, bool with_stats ) {
+	char dir[PATH_MAX];
+	struct stat st;
+	int err;
+
+	o->filename = filename;
+	o->units_separator = units_separator;
+	o->debug = debug;
+	o->use_link = true;
+	o->written_seq = 0;
+	o->stats_written_seq = 0;
+	o->stats_written_ns = 0;
+	o->waiting = false;
+	o->quit = false;
+
+	snprintf(o->tfn, sizeof(o->tfn), "%s.tmp", filename);
+	o->sfn[0] = o->sfn_tmp[0] = '\0';
+	if (with_stats) {
+		snprintf(o->sfn, sizeof(o->sfn), "%s.stats", filename);
+		snprintf(o->sfn_tmp, sizeof(o->sfn_tmp), "%s.stats.tmp", filename);
+	}
+	o->basename = strrchr(filename, '/');
+	o->basename = o->basename ? o->basename +1 : filename;
+
+	if (output_open_tmp(o)) return -1;
+
+	o->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (o->event_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create output eventfd (%s)\r\n", FL, strerror(errno));
+		close(o->tmp_fd);
+		unlink(o->tfn);
+		return -1;
+	}
+
+	/*
+	 * Watch the directory rather than the file, the file comes
+	 * and goes and we need to hear about it going.
+	 */
+	snprintf(dir, sizeof(dir), "%s", filename);
+	o->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (o->inotify_fd >= 0) {
+		if (inotify_add_watch(o->inotify_fd, dirname(dir), IN_DELETE | IN_MOVED_FROM) < 0) {
+			close(o->inotify_fd);
+			o->inotify_fd = -1;
+		}
+	}
+	if (o->inotify_fd < 0) {
+		fprintf(stderr,"%s:%d: inotify unavailable (%s), polling for '%s' instead\r\n", FL, strerror(errno), filename);
+	}
+
+	o->present = (stat(filename, &st) == 0);
+
+	err = pthread_create(&o->tid, NULL, output_thread, o);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start output thread (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand over the newest reading.  Called from the acquisition
+ * thread, a memory copy; and an eventfd write only if the
+ * output thread is sat waiting for it.
+ *
+ */
+void output_publish( struct output_s *o, const struct sample_s *s ) {
+	uint64_t one = 1;
+
+	o->latest.store(*s);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!o->waiting.exchange(false)) return;
+
+	if (write(o->event_fd, &one, sizeof(one)) < 0) { /* counter full, thread is awake anyway */ }
+}
+
+void output_publish_stats( struct output_s *o, const struct runstats_s *rs ) {
+	o->stats.store(*rs);
+}
+
+void output_stop( struct output_s *o ) {
+	o->quit = true;
+	pthread_join(o->tid, NULL);
+
+	if (o->inotify_fd >= 0) close(o->inotify_fd);
+	close(o->event_fd);
+	if (o->tmp_fd >= 0) {
+		close(o->tmp_fd);
+		unlink(o->tfn);
+	}
+}
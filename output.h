@@ -0,0 +1,60 @@
+/*
+ * FlexBV output file
+ *
+ * FlexBV reads the current value from a small text file and
+ * deletes it once read, we then supply the next one.  All file
+ * activity happens on a thread of its own; the acquisition side
+ * only ever calls output_publish(), which never blocks.
+ *
+ * With -a the running statistics go alongside, in <filename>.stats,
+ * rewritten when they've changed but no more than every
+ * OUTPUT_STATS_MS.
+ *
+ */
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <atomic>
+#include <pthread.h>
+
+#include "decoder.h"
+#include "latest.h"
+#include "runstats.h"
+
+#define OUTPUT_IDLE_MS 250  // how often we look for quit, or stats to write, with nothing else going on
+#define OUTPUT_STATS_MS 250 // .stats rewritten at most this often
+
+struct output_s {
+	const char *filename;
+	char tfn[4096];        // our private copy, linked in to place as filename
+	const char *basename;  // filename without the directory, for inotify matching
+	int units_separator;
+	int debug;
+
+	int tmp_fd;
+	int inotify_fd;
+	bool use_link;   // false if the filesystem can't do hard links
+	bool present;    // filename exists and holds our last value
+	uint32_t written_seq;
+
+	latest_slot<struct sample_s> latest;
+	int event_fd;              // kicked by output_publish() when we're waiting on it
+	std::atomic<bool> waiting; // FlexBV wants a value and we've none it hasn't had
+
+
+	char sfn[4096];       // statistics file, empty if not wanted
+	char sfn_tmp[4096];
+	latest_slot<struct runstats_s> stats;
+	uint32_t stats_written_seq;
+	uint64_t stats_written_ns;
+
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+int output_start( struct output_s *o, const char *filename, int units_separator, int debug, bool with_stats );
+void output_publish( struct output_s *o, const struct sample_s *s );
+void output_publish_stats( struct output_s *o, const struct runstats_s *rs );
+void output_stop( struct output_s *o );
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Running statistics
+ *
+ * Kept by the acquisition thread, one set per meter, and handed
+ * on by value with each reading; the display and output file
+ * never see a half updated set.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "runstats.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * windows is the -a argument, up to RUNSTATS_EWMA_MAX comma
+ * separated time constants in seconds, eg "1,10,60"
+ *
+ */
+int runstats_init( struct runstats_s *rs, const char *windows ) {
+	const char *p = windows;
+
+	memset(rs, 0, sizeof(*rs));
+
+	while (p && *p) {
+		char *end;
+		double tau = strtod(p, &end);
+
+		if ((end == p) || (tau <= 0) || (rs->ewma_count >= RUNSTATS_EWMA_MAX)) {
+			fprintf(stderr,"%s:%d: Bad averaging windows '%s', expecting up to %d seconds,seconds...\r\n", FL, windows, RUNSTATS_EWMA_MAX);
+			return -1;
+		}
+		rs->tau[rs->ewma_count++] = tau;
+
+		p = end;
+		if (*p == ',') p++;
+	}
+
+	runstats_reset(rs);
+
+	return 0;
+}
+
+void runstats_reset( struct runstats_s *rs ) {
+	rs->mode = MODE_UNKNOWN;
+	rs->unit = UNIT_NONE;
+	rs->n = 0;
+	rs->overloads = 0;
+	rs->min = rs->max = 0;
+	rs->mean = rs->m2 = 0;
+	rs->slope = 0;
+	rs->last_value = 0;
+	rs->last_ns = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: runstats_add
+  Returns Type	: void
+  ----Parameter List
+  1. struct runstats_s *rs,
+  2. const struct sample_s *s, a fresh (not stale) sample
+  3. uint64_t t_ns, when it was read, CLOCK_MONOTONIC
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The EWMAs are weighted by time rather than sample count,
+	so a window means the same thing whatever rate -sr asks
+	for and however many replies go missing.
+
+	Overloads are counted but otherwise ignored, an 'L' has
+	no value to average.
+
+\------------------------------------------------------------------*/
+void runstats_add( struct runstats_s *rs, const struct sample_s *s, uint64_t t_ns ) {
+	double v = s->value;
+	double dt, delta;
+	int i;
+
+	if (s->mode != rs->mode) {
+		runstats_reset(rs);
+		rs->mode = s->mode;
+		rs->unit = s->unit;
+	}
+
+	if (!isfinite(v)) {
+		rs->overloads++;
+		return;
+	}
+
+	if (rs->n == 0) {
+		rs->n = 1;
+		rs->min = rs->max = rs->mean = v;
+		for (i = 0; i < rs->ewma_count; i++) rs->ewma[i] = v;
+		rs->last_value = v;
+		rs->last_ns = t_ns;
+		return;
+	}
+
+	rs->n++;
+	if (v < rs->min) rs->min = v;
+	if (v > rs->max) rs->max = v;
+
+	delta = v - rs->mean;
+	rs->mean += delta / rs->n;
+	rs->m2 += delta * (v - rs->mean);
+
+	dt = (t_ns > rs->last_ns) ? (t_ns - rs->last_ns) / 1e9 : 0;
+	if (dt > 0) {
+		for (i = 0; i < rs->ewma_count; i++) {
+			rs->ewma[i] += (v - rs->ewma[i]) * (1.0 - exp(-dt / rs->tau[i]));
+		}
+		if (rs->ewma_count) {
+			rs->slope += ((v - rs->last_value) / dt - rs->slope) * (1.0 - exp(-dt / rs->tau[0]));
+		}
+	}
+
+	rs->last_value = v;
+	rs->last_ns = t_ns;
+}
+
+double runstats_stddev( const struct runstats_s *rs ) {
+	if (rs->n < 2) return 0;
+	return sqrt(rs->m2 / (rs->n -1));
+}
+
+/*
+ * Two short lines of text for the small font, in the sample's
+ * base unit; line 0 the hold values, line 1 the averages.
+ *
+ */
+int runstats_format( const struct runstats_s *rs, int line, char *buf, size_t len ) {
+	int o, i;
+
+	if (rs->n == 0) {
+		if (len) buf[0] = '\0';
+		return 0;
+	}
+
+	if (line == 0) {
+		return snprintf(buf, len, "min %.5g max %.5g sd %.3g", rs->min, rs->max, runstats_stddev(rs));
+	}
+
+	o = snprintf(buf, len, "avg %.5g", rs->mean);
+	for (i = 0; (i < rs->ewma_count) && (o < (int)len); i++) {
+		o += snprintf(buf + o, len - o, " %gs %.5g", rs->tau[i], rs->ewma[i]);
+	}
+	if (rs->ewma_count && (o < (int)len)) {
+		o += snprintf(buf + o, len - o, " %+.3g/s", rs->slope);
+	}
+
+	return o;
+}
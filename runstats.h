@@ -0,0 +1,43 @@
+/*
+ * Running statistics
+ *
+ * Min/max hold, mean and standard deviation (Welford), a few
+ * exponentially weighted averages and a smoothed rate of change,
+ * all updated in O(1) per sample with no history kept.  The
+ * numbers only make sense for one meter function at a time, so
+ * they start again whenever the mode changes.
+ *
+ */
+#ifndef __RUNSTATS_H__
+#define __RUNSTATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+#define RUNSTATS_EWMA_MAX 3 // -a windows
+
+struct runstats_s {
+	int ewma_count;
+	float tau[RUNSTATS_EWMA_MAX]; // EWMA time constants, seconds
+
+	uint8_t mode, unit;  // what the numbers below are in, MODE_UNKNOWN until the first sample
+	uint64_t n;          // samples since the last reset, overloads not included
+	uint64_t overloads;
+	double min, max;
+	double mean, m2;     // Welford; variance is m2 / (n-1)
+	double ewma[RUNSTATS_EWMA_MAX];
+	double slope;        // units per second, smoothed over tau[0]
+
+	double last_value;
+	uint64_t last_ns;
+};
+
+int runstats_init( struct runstats_s *rs, const char *windows );
+void runstats_reset( struct runstats_s *rs );
+void runstats_add( struct runstats_s *rs, const struct sample_s *s, uint64_t t_ns );
+double runstats_stddev( const struct runstats_s *rs );
+int runstats_format( const struct runstats_s *rs, int line, char *buf, size_t len );
+
+#endif
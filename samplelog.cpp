@@ -0,0 +1,146 @@
+/*
+ * Binary sample log
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "samplelog.h"
+
+#define FL __FILE__,__LINE__
+
+static_assert(sizeof(struct samplelog_header_s) == 64, "samplelog header layout changed");
+static_assert(sizeof(struct samplelog_record_s) == 32, "samplelog record layout changed");
+
+/*
+ * Grow the file by SAMPLELOG_EXTEND and remap it.  This is the
+ * only place the writer makes system calls after opening.
+ *
+ * The blocks are allocated here and now; a sparse file would
+ * only find out the disk is full when a store through the map
+ * faults, and that's a SIGBUS rather than an error.
+ *
+ */
+static int samplelog_extend( struct samplelog_s *l ) {
+	size_t new_size = l->map_size + SAMPLELOG_EXTEND;
+	void *m;
+	int err;
+
+	err = posix_fallocate(l->fd, l->map_size, SAMPLELOG_EXTEND);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to extend sample log (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+
+	m = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, 0);
+	if (m == MAP_FAILED) {
+		fprintf(stderr,"%s:%d: Unable to map sample log (%s)\r\n", FL, strerror(errno));
+		return -1;
+	}
+
+	if (l->map) munmap(l->map, l->map_size);
+	l->map = (uint8_t *)m;
+	l->map_size = new_size;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: samplelog_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct samplelog_s *l,
+  2. const char *filename,
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: creates filename
+  --------------------------------------------------------------------
+Comments:
+	An existing file is never overwritten, each capture goes
+	in to its own log.
+
+\------------------------------------------------------------------*/
+int samplelog_open( struct samplelog_s *l, const char *filename ) {
+	struct samplelog_header_s *h;
+	struct timespec rt, mt;
+
+	memset(l, 0, sizeof(struct samplelog_s));
+
+	l->fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (l->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create sample log '%s' (%s)\r\n", FL, filename, strerror(errno));
+		return -1;
+	}
+
+	if (samplelog_extend(l)) {
+		close(l->fd);
+		l->fd = -1;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+
+	h = (struct samplelog_header_s *)l->map;
+	memcpy(h->magic, SAMPLELOG_MAGIC, sizeof(h->magic));
+	h->version = SAMPLELOG_VERSION;
+	h->record_size = sizeof(struct samplelog_record_s);
+	h->start_realtime_ns = (uint64_t)rt.tv_sec * 1000000000 + rt.tv_nsec;
+	h->start_mono_ns = (uint64_t)mt.tv_sec * 1000000000 + mt.tv_nsec;
+
+	l->used = sizeof(struct samplelog_header_s);
+
+	return 0;
+}
+
+/*
+ * Append one sample.  The record body goes in first and the
+ * timestamp last, so a reader (or a crash) never sees a half
+ * written record as valid.
+ *
+ */
+int samplelog_append( struct samplelog_s *l, uint64_t t_ns, const struct sample_s *s ) {
+	struct samplelog_record_s *rec;
+
+	if (l->failed) return -1;
+
+	if (l->used + sizeof(struct samplelog_record_s) > l->map_size) {
+		if (samplelog_extend(l)) {
+			fprintf(stderr,"%s:%d: Sample log stopped after %zu readings\r\n", FL
+					, (l->used - sizeof(struct samplelog_header_s)) / sizeof(struct samplelog_record_s));
+			l->failed = true;
+			return -1;
+		}
+	}
+
+	rec = (struct samplelog_record_s *)(l->map + l->used);
+	sample_copy(&rec->s, s);
+	__atomic_store_n(&rec->t_ns, t_ns, __ATOMIC_RELEASE);
+	l->used += sizeof(struct samplelog_record_s);
+
+	return 0;
+}
+
+/*
+ * Trim the zero padding off the end and close up.
+ *
+ */
+void samplelog_close( struct samplelog_s *l ) {
+	if (l->fd < 0) return;
+
+	if (l->map) munmap(l->map, l->map_size);
+	if (ftruncate(l->fd, l->used) != 0) {
+		fprintf(stderr,"%s:%d: Unable to trim sample log (%s)\r\n", FL, strerror(errno));
+	}
+	close(l->fd);
+
+	l->fd = -1;
+	l->map = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * Binary sample log
+ *
+ * Fixed size records appended to a memory mapped file.  The file
+ * is grown in large steps ahead of the writer, so logging a
+ * sample is a plain memory copy with no system call.
+ *
+ * A record is committed by writing its timestamp last; readers
+ * stop at the first record with a zero timestamp.  If we crash
+ * the file is left padded with zeros after the last good record
+ * and nothing before it is disturbed.
+ *
+ */
+#ifndef __SAMPLELOG_H__
+#define __SAMPLELOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+#define SAMPLELOG_MAGIC "VC8145LG"
+#define SAMPLELOG_VERSION 2 // 2 added sample_s.meter
+#define SAMPLELOG_EXTEND (16 * 1024 * 1024) // file grows in 16MB steps
+
+struct samplelog_header_s {
+	char magic[8];
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t reserved;
+	uint64_t start_realtime_ns; // CLOCK_REALTIME and CLOCK_MONOTONIC
+	uint64_t start_mono_ns;     // sampled together when the log was opened
+	uint8_t pad[32];
+};
+
+struct samplelog_record_s {
+	uint64_t t_ns; // CLOCK_MONOTONIC, 0 = not (yet) written
+	struct sample_s s;
+};
+
+struct samplelog_s {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	size_t used; // bytes committed, header included
+	bool failed; // couldn't grow the file, nothing more is logged
+};
+
+int samplelog_open( struct samplelog_s *l, const char *filename );
+int samplelog_append( struct samplelog_s *l, uint64_t t_ns, const struct sample_s *s );
+void samplelog_close( struct samplelog_s *l );
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Live reading server
+ *
+ * One thread, one epoll set; the listening socket, an eventfd the
+ * acquisition thread pokes when it has queued samples, and every
+ * client connection.  Client sockets are non-blocking and only
+ * have EPOLLOUT armed while they have a backlog.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define FL __FILE__,__LINE__
+
+#define SERVER_TAG_LISTEN 0xFFFFFFFF
+#define SERVER_TAG_EVENT  0xFFFFFFFE
+#define SERVER_EPOLL_MS   250 // how often we look for quit
+
+/*
+ * Open the listening socket, either "unix:<path>" or
+ * "tcp:<port>" (localhost only).
+ *
+ */
+static int server_listen( struct server_s *srv, const char *address ) {
+	int fd;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", address +5);
+		snprintf(srv->unix_path, sizeof(srv->unix_path), "%s", address +5);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		unlink(sa.sun_path); // stale socket from a previous run
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+			close(fd);
+			return -1;
+		}
+
+	} else if (strncmp(address, "tcp:", 4) == 0) {
+		struct sockaddr_in sa;
+		int one = 1;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(atoi(address +4));
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+			close(fd);
+			return -1;
+		}
+
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (listen(fd, 8) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void client_close( struct server_s *srv, struct server_client_s *c ) {
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	srv->nclients--;
+}
+
+static void client_accept( struct server_s *srv ) {
+	int fd;
+
+	while ((fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct epoll_event ev;
+		int i;
+
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (srv->clients[i].fd < 0) break;
+		}
+		if (i == SERVER_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		struct server_client_s *c = &(srv->clients[i]);
+		c->fd = fd;
+		c->binary = false;
+		c->want_write = false;
+		c->out_len = c->out_pos = 0;
+		c->head = c->tail = 0;
+		c->dropped = 0;
+		c->in_len = 0;
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		srv->nclients++;
+	}
+}
+
+/*
+ * Queue a sample for a client, throwing away the oldest
+ * one if it's already full.
+ *
+ */
+static void client_queue( struct server_client_s *c, const struct samplelog_record_s *rec ) {
+	if (c->head - c->tail >= SERVER_CLIENT_QUEUE) {
+		c->tail++;
+		c->dropped++;
+	}
+	c->q[c->head % SERVER_CLIENT_QUEUE] = *rec;
+	c->head++;
+}
+
+/*
+ * Encode the next queued sample in to c->out
+ *
+ */
+static void client_encode( struct server_client_s *c ) {
+	const struct samplelog_record_s *rec = &(c->q[c->tail % SERVER_CLIENT_QUEUE]);
+	int n;
+
+	c->tail++;
+	c->out_pos = 0;
+
+	if (c->binary) {
+		struct samplelog_record_s out;
+
+		out.t_ns = rec->t_ns;
+		sample_copy(&out.s, &rec->s); // padding goes out as zeros
+
+		memcpy(c->out, &out, sizeof(out));
+		c->out_len = sizeof(out);
+		return;
+	}
+
+	{
+		char display[64];
+		char value[32];
+
+		sample_format(&rec->s, 0, display, sizeof(display));
+		if (isinf(rec->s.value)) snprintf(value, sizeof(value), "null");
+		else snprintf(value, sizeof(value), "%.9g", rec->s.value);
+
+		n = snprintf(c->out, sizeof(c->out), "{\"mono_ns\":%lu,\"meter\":%u,\"value\":%s,\"unit\":\"%s\",\"mode\":\"%s\",\"display\":\"%s\",\"flags\":%u,\"dropped\":%u}\n"
+				, (unsigned long)rec->t_ns
+				, rec->s.meter
+				, value
+				, sample_unit_name(&rec->s)
+				, sample_mode_name(&rec->s)
+				, display
+				, rec->s.flags
+				, c->dropped
+				);
+	}
+
+	c->dropped = 0;
+	c->out_len = (n < (int)sizeof(c->out)) ? n : sizeof(c->out) -1;
+}
+
+/*
+ * Write as much of the client's backlog as the socket will take,
+ * arming or disarming EPOLLOUT to suit.
+ *
+ */
+static void client_flush( struct server_s *srv, struct server_client_s *c, int index ) {
+	bool blocked = false;
+
+	while (!blocked) {
+		ssize_t n;
+
+		if (c->out_pos == c->out_len) {
+			if (c->head == c->tail) break;
+			client_encode(c);
+		}
+
+		n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				blocked = true;
+			} else if (errno != EINTR) {
+				client_close(srv, c);
+				return;
+			}
+		} else {
+			c->out_pos += n;
+		}
+	}
+
+	if (blocked != c->want_write) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | (blocked ? (uint32_t)EPOLLOUT : 0);
+		ev.data.u32 = index;
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->want_write = blocked;
+	}
+}
+
+/*
+ * Commands from the client, one per line
+ *
+ */
+static void client_read( struct server_s *srv, struct server_client_s *c ) {
+	char buf[256];
+	ssize_t n, i;
+
+	n = recv(c->fd, buf, sizeof(buf), 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(srv, c);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '\n' || buf[i] == '\r') {
+			c->in[c->in_len] = '\0';
+			if (strcmp(c->in, "binary") == 0) c->binary = true;
+			else if (strcmp(c->in, "json") == 0) c->binary = false;
+			c->in_len = 0;
+		} else if (c->in_len < sizeof(c->in) -1) {
+			c->in[c->in_len++] = buf[i];
+		}
+	}
+}
+
+/*
+ * Move everything the acquisition thread has queued out to
+ * the clients.
+ *
+ */
+static void server_fanout( struct server_s *srv ) {
+	struct samplelog_record_s rec;
+	uint64_t count;
+	int i;
+
+	if (read(srv->event_fd, &count, sizeof(count)) < 0) { /* nothing pending is fine */ }
+
+	while (srv->input.pop(rec)) {
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (srv->clients[i].fd >= 0) client_queue(&(srv->clients[i]), &rec);
+		}
+	}
+
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (srv->clients[i].fd >= 0) client_flush(srv, &(srv->clients[i]), i);
+	}
+}
+
+static void *server_thread( void *arg ) {
+	struct server_s *srv = (struct server_s *)arg;
+	struct epoll_event events[SERVER_MAX_CLIENTS +2];
+
+	while (!srv->quit) {
+		int n, i;
+
+		n = epoll_wait(srv->epoll_fd, events, SERVER_MAX_CLIENTS +2, SERVER_EPOLL_MS);
+		for (i = 0; i < n; i++) {
+			uint32_t tag = events[i].data.u32;
+
+			if (tag == SERVER_TAG_LISTEN) {
+				client_accept(srv);
+			} else if (tag == SERVER_TAG_EVENT) {
+				server_fanout(srv);
+			} else {
+				struct server_client_s *c = &(srv->clients[tag]);
+				if ((c->fd >= 0) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) client_read(srv, c);
+				if ((c->fd >= 0) && (events[i].events & EPOLLOUT)) client_flush(srv, c, tag);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: server_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct server_s *srv,
+  2. const char *address, unix:<path> or tcp:<port>
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: starts the server thread
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int server_start( struct server_s *srv, const char *address ) {
+	struct epoll_event ev;
+	int i, err;
+
+	srv->unix_path[0] = '\0';
+	srv->nclients = 0;
+	srv->input_dropped = 0;
+	srv->quit = false;
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) srv->clients[i].fd = -1;
+
+	srv->listen_fd = server_listen(srv, address);
+	if (srv->listen_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to listen on '%s' (%s)\r\n", FL, address, strerror(errno));
+		return -1;
+	}
+
+	srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	srv->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (srv->epoll_fd < 0 || srv->event_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to set up server events (%s)\r\n", FL, strerror(errno));
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = SERVER_TAG_LISTEN;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev);
+	ev.data.u32 = SERVER_TAG_EVENT;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->event_fd, &ev);
+
+	err = pthread_create(&srv->tid, NULL, server_thread, srv);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start server thread (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called from the acquisition thread.  Does nothing at all while
+ * nobody is connected, otherwise a queue push and an eventfd
+ * poke; it never waits on the server or any client.
+ *
+ */
+void server_publish( struct server_s *srv, uint64_t t_ns, const struct sample_s *s ) {
+	struct samplelog_record_s rec;
+	uint64_t one = 1;
+
+	if (srv->nclients == 0) return;
+
+	rec.t_ns = t_ns;
+	rec.s = *s;
+	if (!srv->input.push(rec)) {
+		srv->input_dropped++;
+		return;
+	}
+
+	if (write(srv->event_fd, &one, sizeof(one)) < 0) { /* counter full, server is awake anyway */ }
+}
+
+void server_stop( struct server_s *srv ) {
+	int i;
+
+	srv->quit = true;
+	pthread_join(srv->tid, NULL);
+
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (srv->clients[i].fd >= 0) close(srv->clients[i].fd);
+	}
+	close(srv->listen_fd);
+	close(srv->epoll_fd);
+	close(srv->event_fd);
+	if (srv->unix_path[0]) unlink(srv->unix_path);
+}
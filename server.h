@@ -0,0 +1,66 @@
+/*
+ * Live reading server
+ *
+ * Streams every sample to any number of local subscribers over a
+ * Unix domain socket or a localhost TCP port.  Clients get one
+ * JSON object per line by default; sending "binary\n" switches a
+ * client to raw 32 byte samplelog records ("json\n" switches back).
+ *
+ * Each client has its own bounded queue.  When a client can't
+ * keep up its oldest pending samples are dropped, and the count
+ * of dropped samples is reported in the next JSON line, so one
+ * slow reader never holds up acquisition or the other clients.
+ *
+ */
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "samplelog.h"
+#include "spsc.h"
+
+#define SERVER_MAX_CLIENTS 32
+#define SERVER_CLIENT_QUEUE 256 // samples held per client before dropping
+#define SERVER_INPUT_QUEUE 1024 // acquisition -> server, must be a power of two
+
+struct server_client_s {
+	int fd; // -1 when the slot is free
+	bool binary;
+	bool want_write; // EPOLLOUT armed
+
+	char out[256];   // encoded message currently being sent
+	size_t out_len, out_pos;
+
+	struct samplelog_record_s q[SERVER_CLIENT_QUEUE];
+	size_t head, tail;
+	uint32_t dropped;
+
+	char in[32]; // partial command line
+	size_t in_len;
+};
+
+struct server_s {
+	int listen_fd;
+	int epoll_fd;
+	int event_fd; // kicked by server_publish() when samples are queued
+	char unix_path[108];
+
+	spsc_ring<struct samplelog_record_s, SERVER_INPUT_QUEUE> input;
+	std::atomic<int> nclients;
+	uint32_t input_dropped; // acquisition side only
+
+	struct server_client_s clients[SERVER_MAX_CLIENTS];
+
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+int server_start( struct server_s *srv, const char *address );
+void server_publish( struct server_s *srv, uint64_t t_ns, const struct sample_s *s );
+void server_stop( struct server_s *srv );
+
+#endif
@@ -0,0 +1,421 @@
+/*
+ * Meter simulator / replay device
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "decoder.h"
+#include "simulator.h"
+
+#define FL __FILE__,__LINE__
+
+#define SIM_POLL_MS 100
+#define SIM_BYTE_NS (10 * 1000000000LL / SIM_BAUD) // start + 8 data + stop
+
+/*
+ * Function byte and the ranges the simulator uses for each mode
+ *
+ */
+struct sim_mode_s {
+	const char *name;
+	uint8_t function;
+	uint8_t ranges; // ranges 0..ranges-1 are valid
+};
+
+static const struct sim_mode_s sim_modes[] = {
+	{ "vdc",   0xF0, 4 },
+	{ "vac",   0xF8, 4 },
+	{ "mv",    0xE8, 2 },
+	{ "ohm",   0xE0, 6 },
+	{ "diode", 0xD8, 1 },
+	{ "hz",    0xD0, 6 },
+	{ "cap",   0xC8, 6 },
+	{ "temp",  0xC0, 1 },
+	{ "ma",    0xB0, 2 },
+	{ "a",     0xA8, 1 }
+};
+
+#define SIM_MODES (int)(sizeof(sim_modes) / sizeof(sim_modes[0]))
+#define SIM_CYCLE_FRAMES 200 // frames per mode with mode=cycle
+
+static uint64_t sim_now_ns( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sim_sleep_until( uint64_t t_ns ) {
+	struct timespec ts;
+
+	ts.tv_sec = t_ns / 1000000000;
+	ts.tv_nsec = t_ns % 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * xorshift64*, plenty for made up meter readings and the same
+ * seed always gives the same sequence
+ *
+ */
+static uint32_t sim_random( struct sim_s *sim ) {
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+	return (uint32_t)((sim->rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*
+ * Next frame from the generator; a random walk on the display
+ * value with the odd range change.
+ *
+ */
+static void sim_generate( struct sim_s *sim, uint8_t *d ) {
+	const struct sim_mode_s *m;
+	int32_t v;
+	int i, mode;
+
+	if (sim->script_len) {
+		memcpy(d, sim->script[sim->frames % sim->script_len], DATA_FRAME_SIZE);
+		sim->frames++;
+		return;
+	}
+
+	mode = (sim->mode < 0) ? (sim->frames / SIM_CYCLE_FRAMES) % SIM_MODES : sim->mode;
+	m = &sim_modes[mode];
+
+	sim->count += (int32_t)(sim_random(sim) % 101) - 50;
+	if (sim->count > 99999) sim->count = 99999;
+	if (sim->count < -99999) sim->count = -99999;
+	if ((sim_random(sim) % 500) == 0) sim->range = sim_random(sim) % m->ranges;
+	if (sim->range >= m->ranges) sim->range = 0;
+
+	v = (sim->count < 0) ? -sim->count : sim->count;
+
+	d[0] = DATA_FRAME_HEADER;
+	d[1] = m->function;
+	d[2] = (sim->range << 3) | MMFLAG_AUTORANGE;
+	d[3] = 0;
+	d[4] = (sim->count < 0) ? 0x50 : 0x40;
+	for (i = 4; i >= 0; i--) {
+		d[5 +i] = '0' + (v % 10);
+		v /= 10;
+	}
+	d[10] = 0;
+	d[11] = DATA_FRAME_TERMINATOR;
+
+	sim->frames++;
+}
+
+/*
+ * Send bytes to the host, at wire speed unless told otherwise
+ *
+ */
+static void sim_send( struct sim_s *sim, const uint8_t *b, size_t len ) {
+	if (!sim->fast) sim_sleep_until(sim_now_ns() + len * SIM_BYTE_NS);
+	if (write(sim->master_fd, b, len) < 0) {
+		fprintf(stderr,"%s:%d: Simulator write failed (%s)\r\n", FL, strerror(errno));
+	}
+}
+
+/*
+ * Generator; wait for commands and answer them
+ *
+ */
+static void sim_run_generator( struct sim_s *sim ) {
+	while (!sim->quit) {
+		struct pollfd pfd;
+		uint8_t cmd[64];
+		ssize_t n, i;
+
+		pfd.fd = sim->master_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, SIM_POLL_MS) <= 0) continue;
+
+		n = read(sim->master_fd, cmd, sizeof(cmd));
+		for (i = 0; i < n; i++) {
+			if (cmd[i] == DATA_FRAME_HEADER) {
+				uint8_t d[DATA_FRAME_SIZE];
+				sim_generate(sim, d);
+				sim_send(sim, d, sizeof(d));
+			} else if (cmd[i] == 0xA1) {
+				sim_send(sim, &cmd[i], 1);
+			}
+		}
+	}
+}
+
+/*
+ * Replay; ignore what the host sends and play back the meter's
+ * side of a capture with its original timing.  A file without
+ * a capture header is treated as raw meter bytes and paced at
+ * the wire speed.
+ *
+ */
+static void sim_run_replay( struct sim_s *sim ) {
+	uint8_t discard[256];
+
+	do {
+		struct capture_header_s h;
+		bool raw;
+		uint64_t t0_file = 0, t0 = sim_now_ns();
+		FILE *f;
+
+		f = fopen(sim->replay_file, "rb");
+		if (!f) {
+			fprintf(stderr,"%s:%d: Unable to open replay '%s' (%s)\r\n", FL, sim->replay_file, strerror(errno));
+			return;
+		}
+
+		raw = (fread(&h, sizeof(h), 1, f) != 1) || (memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) != 0);
+		if (raw) rewind(f);
+
+		while (!sim->quit) {
+			struct capture_chunk_s c;
+			uint8_t data[256];
+			uint64_t due;
+
+			if (raw) {
+				c.len = fread(data, 1, 16, f);
+				if (c.len == 0) break;
+				c.dir = CAPTURE_DIR_RX;
+				c.t_ns = 0;
+			} else {
+				if (fread(&c, sizeof(c), 1, f) != 1) break;
+				if (fread(data, 1, c.len, f) != c.len) break;
+				if (!t0_file) t0_file = c.t_ns;
+			}
+
+			while (read(sim->master_fd, discard, sizeof(discard)) > 0);
+
+			if (c.dir != CAPTURE_DIR_RX) continue;
+
+			if (raw) {
+				if (!sim->fast) sim_sleep_until(sim_now_ns() + (uint64_t)(c.len * SIM_BYTE_NS / sim->speed));
+			} else if (!sim->fast) {
+				due = t0 + (uint64_t)((c.t_ns - t0_file) / sim->speed);
+				sim_sleep_until(due);
+			}
+
+			if (write(sim->master_fd, data, c.len) < 0) break;
+		}
+
+		fclose(f);
+	} while (sim->loop && !sim->quit);
+}
+
+static void *sim_thread( void *arg ) {
+	struct sim_s *sim = (struct sim_s *)arg;
+
+	if (sim->replay) sim_run_replay(sim);
+	else sim_run_generator(sim);
+
+	return NULL;
+}
+
+/*
+ * Frames for sim:script=, one per line as hex bytes
+ *
+ */
+static int sim_load_script( struct sim_s *sim, const char *filename ) {
+	char line[256];
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to open script '%s' (%s)\r\n", FL, filename, strerror(errno));
+		return -1;
+	}
+
+	free(sim->script); // script= given more than once
+	sim->script = (uint8_t (*)[DATA_FRAME_SIZE])calloc(SIM_MAX_SCRIPT, DATA_FRAME_SIZE);
+	sim->script_len = 0;
+	if (!sim->script) {
+		fprintf(stderr,"%s:%d: Unable to allocate script\r\n", FL);
+		fclose(f);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) && sim->script_len < SIM_MAX_SCRIPT) {
+		uint8_t *d = sim->script[sim->script_len];
+		char *p = line;
+		int i;
+
+		if (line[0] == '#') continue;
+
+		for (i = 0; i < DATA_FRAME_SIZE; i++) {
+			char *end;
+			d[i] = strtoul(p, &end, 16);
+			if (end == p) break;
+			p = end;
+		}
+		if (i == DATA_FRAME_SIZE) sim->script_len++;
+	}
+	fclose(f);
+
+	if (!sim->script_len) {
+		fprintf(stderr,"%s:%d: No frames in script '%s'\r\n", FL, filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pick apart "sim:a=b,c" / "replay:file,a=b"
+ *
+ */
+static int sim_parse( struct sim_s *sim, const char *spec ) {
+	char buf[1024];
+	char *opt, *save = NULL;
+	const char *p;
+
+	p = strchr(spec, ':');
+	if (!p) return 0;
+	snprintf(buf, sizeof(buf), "%s", p +1);
+
+	opt = strtok_r(buf, ",", &save);
+	if (sim->replay) {
+		if (!opt) return -1;
+		snprintf(sim->replay_file, sizeof(sim->replay_file), "%s", opt);
+		opt = strtok_r(NULL, ",", &save);
+	}
+
+	for (; opt; opt = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(opt, '=');
+		if (val) *val++ = '\0';
+
+		if (strcmp(opt, "seed") == 0 && val) {
+			sim->rng = strtoull(val, NULL, 0);
+		} else if (strcmp(opt, "mode") == 0 && val) {
+			int i;
+			sim->mode = -2;
+			if (strcmp(val, "cycle") == 0) sim->mode = -1;
+			for (i = 0; i < SIM_MODES; i++) {
+				if (strcmp(val, sim_modes[i].name) == 0) sim->mode = i;
+			}
+			if (sim->mode == -2) {
+				fprintf(stderr,"%s:%d: Unknown simulator mode '%s'\r\n", FL, val);
+				return -1;
+			}
+		} else if (strcmp(opt, "script") == 0 && val) {
+			if (sim_load_script(sim, val)) return -1;
+		} else if (strcmp(opt, "speed") == 0 && val) {
+			sim->speed = atof(val);
+			if (sim->speed <= 0) sim->speed = 1;
+		} else if (strcmp(opt, "fast") == 0) {
+			sim->fast = true;
+		} else if (strcmp(opt, "loop") == 0) {
+			sim->loop = true;
+		} else {
+			fprintf(stderr,"%s:%d: Unknown simulator option '%s'\r\n", FL, opt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The pty and script, after sim_stop() or a failed sim_start()
+ *
+ */
+static void sim_free( struct sim_s *sim ) {
+	if (sim->slave_fd >= 0) close(sim->slave_fd);
+	if (sim->master_fd >= 0) close(sim->master_fd);
+	free(sim->script);
+	sim->slave_fd = sim->master_fd = -1;
+	sim->script = NULL;
+}
+
+bool sim_is_device( const char *device ) {
+	if (!device) return false;
+	return (strcmp(device, "sim") == 0) || (strncmp(device, "sim:", 4) == 0) || (strncmp(device, "replay:", 7) == 0);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: sim_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct sim_s *sim,
+  2. const char *spec, -p device string, see simulator.h
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: sim->slave_name is the tty to open
+  --------------------------------------------------------------------
+Comments:
+	The slave side is put in to raw mode here, before anyone
+	writes to the master, so nothing we send gets echoed back
+	to us as if it were a command.
+
+\------------------------------------------------------------------*/
+int sim_start( struct sim_s *sim, const char *spec ) {
+	struct termios tp;
+	int err;
+
+	sim->replay = (strncmp(spec, "replay:", 7) == 0);
+	sim->fast = false;
+	sim->loop = false;
+	sim->speed = 1.0;
+	sim->rng = 0x8145;
+	sim->mode = 0;
+	sim->count = 12345;
+	sim->range = 0;
+	sim->frames = 0;
+	sim->script = NULL;
+	sim->script_len = 0;
+	sim->replay_file[0] = '\0';
+	sim->master_fd = sim->slave_fd = -1;
+	sim->quit = false;
+
+	if (sim_parse(sim, spec)) {
+		sim_free(sim);
+		return -1;
+	}
+	if (!sim->rng) sim->rng = 1; // xorshift can't start from 0
+
+	sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((sim->master_fd < 0) || grantpt(sim->master_fd) || unlockpt(sim->master_fd) || ptsname_r(sim->master_fd, sim->slave_name, sizeof(sim->slave_name))) {
+		fprintf(stderr,"%s:%d: Unable to create simulator pty (%s)\r\n", FL, strerror(errno));
+		sim_free(sim);
+		return -1;
+	}
+
+	sim->slave_fd = open(sim->slave_name, O_RDWR | O_NOCTTY);
+	if (sim->slave_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, sim->slave_name, strerror(errno));
+		sim_free(sim);
+		return -1;
+	}
+	tcgetattr(sim->slave_fd, &tp);
+	cfmakeraw(&tp);
+	tcsetattr(sim->slave_fd, TCSANOW, &tp);
+
+	fcntl(sim->master_fd, F_SETFL, O_NONBLOCK);
+
+	err = pthread_create(&sim->tid, NULL, sim_thread, sim);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start simulator thread (%s)\r\n", FL, strerror(err));
+		sim_free(sim);
+		return -1;
+	}
+
+	return 0;
+}
+
+void sim_stop( struct sim_s *sim ) {
+	sim->quit = true;
+	pthread_join(sim->tid, NULL);
+
+	sim_free(sim);
+}
@@ -0,0 +1,61 @@
+/*
+ * Meter simulator / replay device
+ *
+ * Stands in for a VC8145 on the far end of a pty pair, so the
+ * whole pipeline can be run without hardware.  Selected with the
+ * -p device name:
+ *
+ *   sim[:option,...]        answer 0x89/0xA1 with generated frames
+ *       seed=<n>            pseudo random sequence, same seed same frames
+ *       mode=<vdc|vac|mv|ohm|diode|hz|cap|temp|ma|a|cycle>
+ *       script=<file>       frames to send, one per line as hex bytes
+ *       fast                don't pace replies at 9600 baud
+ *
+ *   replay:<file>[,option,...]  play back a capture (or raw bytes)
+ *       speed=<x>           time scale, 2 = twice as fast
+ *       loop                start again at the end
+ *
+ */
+#ifndef __SIMULATOR_H__
+#define __SIMULATOR_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+#define SIM_BAUD 9600
+#define SIM_MAX_SCRIPT 4096 // frames
+
+struct sim_s {
+	int master_fd;
+	int slave_fd;  // held open so the pty keeps its settings
+	char slave_name[64];
+
+	bool replay;
+	bool fast;
+	bool loop;
+	double speed;
+
+	/* generator */
+	uint64_t rng;
+	int mode;      // index in to the simulator mode table, -1 cycles
+	int32_t count; // value on the display, -99999..99999
+	uint8_t range;
+	uint32_t frames;
+
+	uint8_t (*script)[DATA_FRAME_SIZE];
+	int script_len;
+
+	char replay_file[1024];
+
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+bool sim_is_device( const char *device );
+int sim_start( struct sim_s *sim, const char *spec );
+void sim_stop( struct sim_s *sim );
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Single producer / single consumer ring
+ *
+ * Lock free hand-off between exactly one writing thread and
+ * one reading thread.  N must be a power of two.  The producer
+ * never waits; push() simply fails when the ring is full and
+ * it is up to the caller to count or otherwise deal with that.
+ *
+ */
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <atomic>
+#include <stddef.h>
+
+template <typename T, size_t N>
+struct spsc_ring {
+	static_assert((N & (N -1)) == 0, "spsc_ring size must be a power of two");
+
+	alignas(64) std::atomic<size_t> head{0}; // written by producer
+	alignas(64) std::atomic<size_t> tail{0}; // written by consumer
+	alignas(64) T slot[N];
+
+	bool push( const T &v ) {
+		size_t h = head.load(std::memory_order_relaxed);
+
+		if (h - tail.load(std::memory_order_acquire) >= N) return false;
+		slot[h & (N -1)] = v;
+		head.store(h +1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop( T &v ) {
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		if (t == head.load(std::memory_order_acquire)) return false;
+		v = slot[t & (N -1)];
+		tail.store(t +1, std::memory_order_release);
+		return true;
+	}
+
+	/*
+	 * Discard everything queued except the newest entry,
+	 * handy for a display that only cares about "now".
+	 */
+	bool pop_latest( T &v ) {
+		bool got = false;
+
+		while (pop(v)) got = true;
+		return got;
+	}
+};
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Instrumentation
+ *
+ * Histogram buckets run 0..15 linearly, then each power of two
+ * from 16 up is split in to 16 equal steps.  Nanoseconds through
+ * to centuries fit in under a thousand buckets.
+ *
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define FL __FILE__,__LINE__
+
+#define METRICS_POLL_MS 250 // how often we look for quit
+#define METRICS_IO_TIMEOUT 1 // seconds a client gets to send its request / take the reply
+#define METRICS_BUFFER 16384
+
+struct stats_s stats;
+
+static const char *stage_names[STAGE_COUNT] = { "reply", "decode", "render", "present", "output" };
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_names[COUNT_COUNT] = {
+	{ "frames", "Good replies from the meter" },
+	{ "frame_errors", "Replies rejected for a bad header or length" },
+	{ "timeouts", "Requests that got no reply" },
+	{ "resyncs", "Times received bytes were discarded to find a frame" },
+	{ "readings_dropped", "Readings the display queue had no room for" },
+	{ "commands", "Meter commands acknowledged" },
+	{ "command_retries", "Meter commands resent for want of an echo" },
+	{ "command_failures", "Meter commands given up on" },
+	{ "triggers", "Trigger captures saved" },
+	{ "triggers_missed", "Triggers fired while the last capture was still being written" },
+	{ "wire_dumps", "Wire captures saved" },
+	{ "wire_dumps_missed", "Wire dumps asked for while the last was still being written" }
+};
+
+/*
+ * Prometheus histogram bounds, seconds; 1-2.5-5 per decade
+ * from 1us to 10s
+ *
+ */
+static const double prom_bounds[] = {
+	1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+	1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5,
+	1, 2.5, 5, 10
+};
+
+static int bucket_index( uint64_t v ) {
+	int msb, shift;
+
+	if (v < STATS_SUB_BUCKETS) return (int)v;
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - STATS_SUB_BITS;
+	return (shift +1) * STATS_SUB_BUCKETS + (int)((v >> shift) & (STATS_SUB_BUCKETS -1));
+}
+
+static uint64_t bucket_low( int i ) {
+	int shift;
+
+	if (i < STATS_SUB_BUCKETS) return i;
+
+	shift = i / STATS_SUB_BUCKETS -1;
+	return (uint64_t)(STATS_SUB_BUCKETS + (i % STATS_SUB_BUCKETS)) << shift;
+}
+
+static uint64_t bucket_high( int i ) {
+	if (i < STATS_SUB_BUCKETS) return i;
+	return bucket_low(i) + ((uint64_t)1 << (i / STATS_SUB_BUCKETS -1)) -1;
+}
+
+/*
+ * Time taken by one pass through a stage.  Only ever called
+ * from the one thread that owns the stage, so the min/max
+ * updates needn't be atomic read-modify-writes.
+ *
+ */
+void stats_record( int stage, uint64_t ns ) {
+	struct stats_hist_s *h = &stats.stage[stage];
+
+	if (!h->count.load(std::memory_order_relaxed) || (ns < h->min.load(std::memory_order_relaxed))) h->min.store(ns, std::memory_order_relaxed);
+	if (ns > h->max.load(std::memory_order_relaxed)) h->max.store(ns, std::memory_order_relaxed);
+
+	h->buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+	h->sum.fetch_add(ns, std::memory_order_relaxed);
+	h->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void stats_count( int counter, uint64_t n ) {
+	stats.counter[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+/*
+ * Value at or below which fraction p of the recordings fall,
+ * taken as the middle of the bucket it lands in
+ *
+ */
+static uint64_t hist_percentile( struct stats_hist_s *h, uint64_t count, double p ) {
+	uint64_t target = (uint64_t)(count * p + 0.5);
+	uint64_t seen = 0;
+	uint64_t min = h->min.load(std::memory_order_relaxed);
+	uint64_t max = h->max.load(std::memory_order_relaxed);
+	int i;
+
+	if (target < 1) target = 1;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += h->buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target) {
+			uint64_t v = bucket_low(i) + (bucket_high(i) - bucket_low(i)) / 2;
+			if (v < min) return min;
+			return (v > max) ? max : v;
+		}
+	}
+
+	return max;
+}
+
+/*
+ * Human readable summary, SIGUSR1 and at exit
+ *
+ */
+void stats_dump( FILE *f ) {
+	int i;
+
+	fprintf(f,"\r\n%-8s %10s %10s %10s %10s %10s %10s %10s %10s\r\n", "stage", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		struct stats_hist_s *h = &stats.stage[i];
+		uint64_t count = h->count.load(std::memory_order_relaxed);
+
+		if (!count) {
+			fprintf(f,"%-8s %10d\r\n", stage_names[i], 0);
+			continue;
+		}
+
+		/* microseconds */
+		fprintf(f,"%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\r\n"
+				, stage_names[i]
+				, (unsigned long)count
+				, h->min.load(std::memory_order_relaxed) / 1e3
+				, h->sum.load(std::memory_order_relaxed) / 1e3 / count
+				, hist_percentile(h, count, 0.5) / 1e3
+				, hist_percentile(h, count, 0.9) / 1e3
+				, hist_percentile(h, count, 0.99) / 1e3
+				, hist_percentile(h, count, 0.999) / 1e3
+				, h->max.load(std::memory_order_relaxed) / 1e3
+				);
+	}
+	fprintf(f,"(times in us)\r\n");
+
+	for (i = 0; i < COUNT_COUNT; i++) {
+		fprintf(f,"%-18s %lu\r\n", counter_names[i].name, (unsigned long)stats.counter[i].load(std::memory_order_relaxed));
+	}
+	fflush(f);
+}
+
+/*
+ * Prometheus text exposition format.  Our buckets are far finer
+ * than anyone wants to scrape, so they're folded down on to
+ * prom_bounds[]; a bucket counts as under a bound if it starts
+ * there, good to the same ~6% as the histogram itself.
+ *
+ * Returns the length of the text.
+ *
+ */
+size_t stats_prometheus( char *buf, size_t len ) {
+	size_t n = 0;
+	int i, j, b;
+
+#define PROM_APPEND(...) do { int r = snprintf(buf +n, (n < len) ? len -n : 0, __VA_ARGS__); if (r > 0) n += r; } while (0)
+
+	PROM_APPEND("# HELP vc8145_stage_seconds Time spent in each stage of acquisition and display\n");
+	PROM_APPEND("# TYPE vc8145_stage_seconds histogram\n");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		struct stats_hist_s *h = &stats.stage[i];
+		uint64_t cumulative = 0;
+		uint64_t count;
+
+		b = 0;
+		for (j = 0; j < (int)(sizeof(prom_bounds) / sizeof(prom_bounds[0])); j++) {
+			uint64_t bound_ns = (uint64_t)(prom_bounds[j] * 1e9);
+
+			while ((b < STATS_BUCKETS) && (bucket_low(b) <= bound_ns)) {
+				cumulative += h->buckets[b].load(std::memory_order_relaxed);
+				b++;
+			}
+			PROM_APPEND("vc8145_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stage_names[i], prom_bounds[j], (unsigned long)cumulative);
+		}
+
+		/*
+		 * Buckets may have been added to since we walked them,
+		 * the total has to be at least what we counted.
+		 */
+		count = h->count.load(std::memory_order_relaxed);
+		while (b < STATS_BUCKETS) cumulative += h->buckets[b++].load(std::memory_order_relaxed);
+		if (count < cumulative) count = cumulative;
+
+		PROM_APPEND("vc8145_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage_names[i], (unsigned long)count);
+		PROM_APPEND("vc8145_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[i], h->sum.load(std::memory_order_relaxed) / 1e9);
+		PROM_APPEND("vc8145_stage_seconds_count{stage=\"%s\"} %lu\n", stage_names[i], (unsigned long)count);
+	}
+
+	for (i = 0; i < COUNT_COUNT; i++) {
+		PROM_APPEND("# HELP vc8145_%s_total %s\n", counter_names[i].name, counter_names[i].help);
+		PROM_APPEND("# TYPE vc8145_%s_total counter\n", counter_names[i].name);
+		PROM_APPEND("vc8145_%s_total %lu\n", counter_names[i].name, (unsigned long)stats.counter[i].load(std::memory_order_relaxed));
+	}
+
+#undef PROM_APPEND
+
+	return (n < len) ? n : len -1;
+}
+
+/*
+ * Answer one scrape; whatever was asked for, they get the
+ * metrics.  The client socket is blocking but with timeouts,
+ * so a stalled scraper can't wedge us for long.
+ *
+ */
+static void metrics_client( int fd ) {
+	char request[1024];
+	char *buf;
+	struct timeval tv;
+	size_t len, body, sent = 0;
+
+	tv.tv_sec = METRICS_IO_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (read(fd, request, sizeof(request)) <= 0) return;
+
+	buf = (char *)malloc(METRICS_BUFFER);
+	if (!buf) return;
+
+	len = snprintf(buf, METRICS_BUFFER, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	body = stats_prometheus(buf +len, METRICS_BUFFER -len);
+	len += body;
+
+	while (sent < len) {
+		ssize_t n = write(fd, buf +sent, len -sent);
+		if (n <= 0) break;
+		sent += n;
+	}
+
+	free(buf);
+}
+
+static void *metrics_thread( void *arg ) {
+	struct metrics_s *m = (struct metrics_s *)arg;
+
+	while (!m->quit) {
+		struct pollfd pfd;
+		int fd;
+
+		pfd.fd = m->listen_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) continue;
+
+		fd = accept4(m->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) continue;
+
+		metrics_client(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: metrics_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct metrics_s *m,
+  2. const char *address, "tcp:<port>"
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: starts the metrics thread
+  --------------------------------------------------------------------
+Comments:
+	Bound to localhost only, same as the -S server.
+
+\------------------------------------------------------------------*/
+int metrics_start( struct metrics_s *m, const char *address ) {
+	struct sockaddr_in sa;
+	int one = 1;
+	int err;
+
+	m->quit = false;
+
+	if (strncmp(address, "tcp:", 4) != 0) {
+		fprintf(stderr,"%s:%d: Metrics address must be tcp:<port>, not '%s'\r\n", FL, address);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(address +4));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	m->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m->listen_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create metrics socket (%s)\r\n", FL, strerror(errno));
+		return -1;
+	}
+	setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if ((bind(m->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(m->listen_fd, 4) != 0)) {
+		fprintf(stderr,"%s:%d: Unable to listen on '%s' (%s)\r\n", FL, address, strerror(errno));
+		close(m->listen_fd);
+		return -1;
+	}
+
+	err = pthread_create(&m->tid, NULL, metrics_thread, m);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start metrics thread (%s)\r\n", FL, strerror(err));
+		close(m->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_stop( struct metrics_s *m ) {
+	m->quit = true;
+	pthread_join(m->tid, NULL);
+	close(m->listen_fd);
+}
@@ -0,0 +1,99 @@
+/*
+ * Instrumentation
+ *
+ * Counters and latency histograms for each stage of getting a
+ * reading from the meter to the screen / output file.  Recording
+ * is a handful of relaxed atomic adds, cheap enough to leave on
+ * all the time.  Dumped on SIGUSR1 and at exit, and optionally
+ * served in Prometheus text format with -M.
+ *
+ * Histograms are log-linear in the manner of HdrHistogram; each
+ * power of two is split in to STATS_SUB_BUCKETS, so any recorded
+ * value is known to within about 6%.  Each stage has exactly one
+ * writing thread, anyone may read.
+ *
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS +1) * STATS_SUB_BUCKETS)
+
+enum stats_stage {
+	STAGE_REPLY,   // 0x89 written to 0x0A read
+	STAGE_DECODE,  // decode_frame()
+	STAGE_RENDER,  // building the frame for SDL
+	STAGE_PRESENT, // SDL_RenderPresent()
+	STAGE_OUTPUT,  // FlexBV output file write
+	STAGE_COUNT
+};
+
+enum stats_counter {
+	COUNT_FRAMES,       // good replies
+	COUNT_FRAME_ERRORS, // replies rejected, bad header or length
+	COUNT_TIMEOUTS,     // no reply in SERIAL_TIMEOUT_MS
+	COUNT_RESYNCS,      // received bytes thrown away to find a frame
+	COUNT_READINGS_DROPPED, // display queue full
+	COUNT_COMMANDS,         // meter commands acknowledged
+	COUNT_COMMAND_RETRIES,  // meter commands sent again for want of an echo
+	COUNT_COMMAND_FAILURES, // meter commands given up on
+	COUNT_TRIGGERS,         // -t captures saved
+	COUNT_TRIGGERS_MISSED,  // -t fired while the last capture was still being written
+	COUNT_WIRE_DUMPS,        // wire captures saved
+	COUNT_WIRE_DUMPS_MISSED, // wire dumps asked for while the last was still being written
+	COUNT_COUNT
+};
+
+struct stats_hist_s {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> min, max;
+	std::atomic<uint64_t> buckets[STATS_BUCKETS];
+};
+
+struct stats_s {
+	struct stats_hist_s stage[STAGE_COUNT];
+	std::atomic<uint64_t> counter[COUNT_COUNT];
+	std::atomic<bool> dump_requested; // set from the SIGUSR1 handler
+};
+
+extern struct stats_s stats;
+
+/*
+ * Prometheus endpoint, a minimal HTTP/1.0 responder
+ * on "tcp:<port>" (localhost only)
+ *
+ */
+struct metrics_s {
+	int listen_fd;
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+/*
+ * CLOCK_MONOTONIC in ns, for timing stages
+ *
+ */
+static inline uint64_t stats_now_ns( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record( int stage, uint64_t ns );
+void stats_count( int counter, uint64_t n );
+void stats_dump( FILE *f );
+size_t stats_prometheus( char *buf, size_t len );
+
+int metrics_start( struct metrics_s *m, const char *address );
+void metrics_stop( struct metrics_s *m );
+
+#endif
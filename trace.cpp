@@ -0,0 +1,237 @@
+/*
+ * Debug trace
+ *
+ * Each thread claims a ring of its own the first time it traces
+ * anything, so there is only ever one writer per ring and the
+ * formatter thread is its one reader.
+ *
+ */
+
+#include <atomic>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spsc.h"
+#include "stats.h"
+#include "trace.h"
+
+#define FL __FILE__,__LINE__
+
+struct trace_ring_s {
+	spsc_ring<struct trace_rec_s, TRACE_RING> q;
+	std::atomic<uint64_t> dropped;
+};
+
+static struct trace_ring_s rings[TRACE_THREADS];
+static std::atomic<int> rings_claimed{0};
+static std::atomic<uint64_t> unringed{0}; // records from threads beyond TRACE_THREADS
+static thread_local struct trace_ring_s *my_ring = NULL;
+
+static struct {
+	FILE *f;
+	std::atomic<bool> running;
+	std::atomic<bool> quit;
+	uint64_t start_ns;
+	uint64_t dropped_reported;
+	pthread_t tid;
+} tr;
+
+static struct trace_rec_s batch[TRACE_THREADS * TRACE_RING]; // formatter thread only
+
+static struct trace_ring_s *trace_ring( void ) {
+	int i;
+
+	if (my_ring) return my_ring;
+
+	i = rings_claimed.fetch_add(1);
+	if (i >= TRACE_THREADS) return NULL;
+	my_ring = &rings[i];
+
+	return my_ring;
+}
+
+static void trace_put( int event, int source, uint64_t t_ns, const void *data, size_t len ) {
+	struct trace_ring_s *r = trace_ring();
+	struct trace_rec_s rec;
+
+	if (!r) {
+		unringed.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	rec.t_ns = t_ns;
+	rec.event = event;
+	rec.source = (source < 0) ? TRACE_NO_SOURCE : source;
+	rec.len = len;
+	memcpy(rec.data, data, len);
+
+	if (!r->q.push(rec)) r->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Raw bytes or text; anything longer than TRACE_DATA is
+ * split over several records with the same timestamp
+ *
+ */
+void trace_bytes( int event, int source, const void *data, size_t len ) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t t_ns;
+
+	if (!tr.running.load(std::memory_order_relaxed)) return;
+
+	t_ns = stats_now_ns();
+	do {
+		size_t n = (len > TRACE_DATA) ? TRACE_DATA : len;
+		trace_put(event, source, t_ns, p, n);
+		p += n;
+		len -= n;
+	} while (len);
+}
+
+void trace_values( int event, int source, uint64_t a, uint64_t b ) {
+	uint64_t v[2] = { a, b };
+
+	if (!tr.running.load(std::memory_order_relaxed)) return;
+
+	trace_put(event, source, stats_now_ns(), v, sizeof(v));
+}
+
+static void trace_format( const struct trace_rec_s *rec ) {
+	FILE *f = tr.f;
+	uint64_t v[2] = { 0, 0 };
+	int i;
+
+	memcpy(v, rec->data, (rec->len < sizeof(v)) ? rec->len : sizeof(v));
+
+	fprintf(f,"%12.6f ", (rec->t_ns - tr.start_ns) / 1e9);
+	if (rec->source != TRACE_NO_SOURCE) fprintf(f,"[%d] ", rec->source);
+
+	switch (rec->event) {
+		case TRACE_TX:
+		case TRACE_RX:
+			fprintf(f,"%s", (rec->event == TRACE_TX) ? "TX" : "RX");
+			for (i = 0; i < rec->len; i++) fprintf(f," %02x", rec->data[i]);
+			break;
+
+		case TRACE_FRAME:
+			fprintf(f,"DATA START: ");
+			for (i = 0; i < rec->len; i++) fprintf(f,"%02x ", rec->data[i]);
+			fprintf(f,":END [%d bytes]", rec->len);
+			break;
+
+		case TRACE_RESYNC:
+			fprintf(f,"Skipped %lu bytes looking for a frame", (unsigned long)v[0]);
+			break;
+
+		case TRACE_REPLY:
+			fprintf(f,"0x89 to first byte %.2fms, to 0x0A %.2fms", v[0] / 1e6, v[1] / 1e6);
+			break;
+
+		case TRACE_RANGE:
+			fprintf(f,"Range %d => DP=%d", (int)(int64_t)v[0], (int)(int64_t)v[1]);
+			break;
+
+		case TRACE_CMD_FAILED:
+			fprintf(f,"No echo for command %02x, giving up", (unsigned)v[0]);
+			break;
+
+		case TRACE_OUTPUT:
+			fprintf(f,"Output '%.*s'", rec->len, (const char *)rec->data);
+			break;
+
+		default:
+			fprintf(f,"Event %d, %d bytes", rec->event, rec->len);
+	}
+
+	fprintf(f,"\r\n");
+}
+
+static int trace_cmp( const void *a, const void *b ) {
+	uint64_t ta = ((const struct trace_rec_s *)a)->t_ns;
+	uint64_t tb = ((const struct trace_rec_s *)b)->t_ns;
+
+	return (ta < tb) ? -1 : (ta > tb);
+}
+
+/*
+ * Everything queued so far, from every thread, in time order
+ *
+ */
+static void trace_collect( void ) {
+	size_t n = 0, i;
+	uint64_t dropped;
+	int claimed = rings_claimed.load();
+
+	if (claimed > TRACE_THREADS) claimed = TRACE_THREADS;
+
+	dropped = unringed.load(std::memory_order_relaxed);
+	for (i = 0; i < (size_t)claimed; i++) {
+		while (rings[i].q.pop(batch[n])) n++;
+		dropped += rings[i].dropped.load(std::memory_order_relaxed);
+	}
+
+	qsort(batch, n, sizeof(batch[0]), trace_cmp);
+	for (i = 0; i < n; i++) trace_format(&batch[i]);
+
+	if (dropped != tr.dropped_reported) {
+		fprintf(tr.f,"trace: %lu records dropped\r\n", (unsigned long)(dropped - tr.dropped_reported));
+		tr.dropped_reported = dropped;
+	}
+	if (n) fflush(tr.f);
+}
+
+static void *trace_thread( void * ) {
+	while (!tr.quit) {
+		trace_collect();
+		usleep(TRACE_WAIT_MS * 1000);
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: trace_start
+  Returns Type	: int
+  ----Parameter List
+  1. FILE *f, where the formatted trace goes
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: starts the formatter thread, until then tracing is a no-op
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int trace_start( FILE *f ) {
+	int err;
+
+	tr.f = f;
+	tr.quit = false;
+	tr.start_ns = stats_now_ns();
+	tr.dropped_reported = 0;
+
+	err = pthread_create(&tr.tid, NULL, trace_thread, NULL);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start trace thread (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+	tr.running = true;
+
+	return 0;
+}
+
+/*
+ * Stop taking records and write out whatever is left.  Anything
+ * still tracing will find tracing off and do nothing.
+ *
+ */
+void trace_stop( void ) {
+	if (!tr.running) return;
+
+	tr.running = false;
+	tr.quit = true;
+	pthread_join(tr.tid, NULL);
+	trace_collect();
+}
@@ -0,0 +1,55 @@
+/*
+ * Debug trace
+ *
+ * What -d used to print straight to stderr from the serial code,
+ * now written as small binary records in to a lock free ring
+ * belonging to the calling thread; a background thread collects
+ * them from every ring, puts them in time order and formats them.
+ * Tracing an event costs a clock read and a 32 byte copy, so
+ * turning on -d no longer changes the timing it's meant to show.
+ *
+ * Records that find their ring full are counted and dropped, and
+ * whatever is still queued at exit is written out by trace_stop().
+ *
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_THREADS 8   // threads that may trace
+#define TRACE_RING 4096   // records per thread, must be a power of two
+#define TRACE_DATA 20     // payload bytes per record
+#define TRACE_WAIT_MS 20  // how often the formatter looks for records
+
+enum trace_event {
+	TRACE_TX,          // bytes written to the meter
+	TRACE_RX,          // bytes read from the meter
+	TRACE_FRAME,       // a good frame, the 12 bytes
+	TRACE_RESYNC,      // u64 bytes skipped looking for a frame
+	TRACE_REPLY,       // u64 ns 0x89 to first byte, u64 ns to 0x0A
+	TRACE_RANGE,       // u64 range, u64 dp
+	TRACE_CMD_FAILED,  // u64 command that was never echoed
+	TRACE_OUTPUT,      // text handed to FlexBV
+	TRACE_EVENT_COUNT
+};
+
+struct trace_rec_s {
+	uint64_t t_ns;   // CLOCK_MONOTONIC
+	uint16_t event;  // enum trace_event
+	uint8_t source;  // meter index, or 0xFF for none
+	uint8_t len;     // bytes used in data
+	uint8_t data[TRACE_DATA];
+};
+
+#define TRACE_NO_SOURCE 0xFF
+
+int trace_start( FILE *f );
+void trace_stop( void );
+
+void trace_bytes( int event, int source, const void *data, size_t len );
+void trace_values( int event, int source, uint64_t a, uint64_t b );
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Trend graph
+ *
+ * With 4 levels of 4096 buckets and a factor of 8 the top level
+ * covers 2M samples, a good few hours at the meter's full rate.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trend.h"
+
+#define FL __FILE__,__LINE__
+
+int trend_init( struct trend_s *t ) {
+	t->levels = (struct trend_level_s *)calloc(TREND_LEVELS, sizeof(struct trend_level_s));
+	t->columns = (struct trend_bucket_s *)calloc(TREND_MAX_WIDTH, sizeof(struct trend_bucket_s));
+	t->points = (SDL_Point *)calloc(TREND_MAX_WIDTH * 2, sizeof(SDL_Point));
+	t->span = 0;
+
+	if (!t->levels || !t->columns || !t->points) {
+		fprintf(stderr,"%s:%d: Unable to allocate trend buffers\r\n", FL);
+		trend_free(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+void trend_free( struct trend_s *t ) {
+	free(t->levels);
+	free(t->columns);
+	free(t->points);
+	t->levels = NULL;
+	t->columns = NULL;
+	t->points = NULL;
+}
+
+/*
+ * Forget the history, eg when the meter changes mode and the
+ * old values no longer mean the same thing
+ *
+ */
+void trend_clear( struct trend_s *t ) {
+	int l;
+
+	for (l = 0; l < TREND_LEVELS; l++) {
+		t->levels[l].count = 0;
+		t->levels[l].pending_n = 0;
+	}
+}
+
+/*
+ * Add one sample; written to level 0, and rolled up in to
+ * each level above as its buckets fill.
+ *
+ */
+void trend_add( struct trend_s *t, double v ) {
+	struct trend_bucket_s b;
+	int l;
+
+	if (!isfinite(v)) return; // overloads have no place on the graph
+
+	b.min = b.max = v;
+
+	for (l = 0; l < TREND_LEVELS; l++) {
+		struct trend_level_s *lv = &(t->levels[l]);
+		struct trend_level_s *up;
+
+		lv->b[lv->count & (TREND_LEVEL_SIZE -1)] = b;
+		lv->count++;
+
+		if (l == TREND_LEVELS -1) break;
+
+		up = &(t->levels[l +1]);
+		if (up->pending_n == 0) {
+			up->pending = b;
+		} else {
+			if (b.min < up->pending.min) up->pending.min = b.min;
+			if (b.max > up->pending.max) up->pending.max = b.max;
+		}
+		if (++up->pending_n < TREND_FACTOR) break;
+
+		b = up->pending;
+		up->pending_n = 0;
+	}
+}
+
+/*
+ * Double (out) or halve the time across the graph, no closer
+ * than a sample per pixel and no further than we keep.
+ *
+ */
+void trend_zoom( struct trend_s *t, int width, int out ) {
+	size_t max_span = TREND_LEVEL_SIZE;
+	int l;
+
+	for (l = 1; l < TREND_LEVELS; l++) max_span *= TREND_FACTOR;
+
+	if (t->span < (size_t)width) t->span = width;
+	if (out) t->span *= 2;
+	else t->span /= 2;
+
+	if (t->span < (size_t)width) t->span = width;
+	if (t->span > max_span) t->span = max_span;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: trend_draw
+  Returns Type	: int
+  ----Parameter List
+  1. struct trend_s *t,
+  2. SDL_Renderer *renderer, draw colour already set
+  3. int x, y, w, h, area to draw in, newest sample at the right
+  ------------------
+  Exit Codes	: 0, or -1 if there's nothing to draw yet
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Use the coarsest level with no more than one bucket per
+	pixel's worth of samples, fold its buckets down to one
+	min/max pair per column and join them up as a single
+	polyline.  The vertical scale fits whatever is in view.
+
+	At the coarser levels the newest few samples only appear
+	once their bucket is complete.
+
+	Past TREND_MAX_WIDTH the columns are spread out to fill w,
+	each one a pixel or two wide.
+
+\------------------------------------------------------------------*/
+int trend_draw( struct trend_s *t, SDL_Renderer *renderer, int x, int y, int w, int h ) {
+	struct trend_level_s *lv;
+	size_t span, per_pixel, bucket = 1;
+	uint64_t n, first;
+	float lo = 0, hi = 0;
+	int l = 0, width, cols, c, np = 0;
+
+	if ((w < 2) || (h < 2)) return -1;
+
+	width = (w > TREND_MAX_WIDTH) ? TREND_MAX_WIDTH : w; // in columns
+
+	span = (t->span < (size_t)w) ? w : t->span;
+	per_pixel = span / width;
+
+	while ((l < TREND_LEVELS -1) && ((bucket * TREND_FACTOR <= per_pixel) || (span / bucket > TREND_LEVEL_SIZE))) {
+		bucket *= TREND_FACTOR;
+		l++;
+	}
+	lv = &(t->levels[l]);
+
+	/*
+	 * Buckets in view, limited by what's been kept
+	 */
+	n = span / bucket;
+	if (n > lv->count) n = lv->count;
+	if (n > TREND_LEVEL_SIZE) n = TREND_LEVEL_SIZE;
+	if (n == 0) return -1;
+	first = lv->count - n;
+
+	/*
+	 * Short history, one bucket per column up against the
+	 * right hand edge; otherwise n buckets spread over width.
+	 */
+	cols = (n < (uint64_t)width) ? (int)n : width;
+
+	for (c = 0; c < cols; c++) {
+		uint64_t a = first + (n * c) / cols;
+		uint64_t b = first + (n * (c +1)) / cols;
+		struct trend_bucket_s *m = &(t->columns[c]);
+
+		*m = lv->b[a & (TREND_LEVEL_SIZE -1)];
+		for (a++; a < b; a++) {
+			const struct trend_bucket_s *p = &(lv->b[a & (TREND_LEVEL_SIZE -1)]);
+			if (p->min < m->min) m->min = p->min;
+			if (p->max > m->max) m->max = p->max;
+		}
+
+		if ((c == 0) || (m->min < lo)) lo = m->min;
+		if ((c == 0) || (m->max > hi)) hi = m->max;
+	}
+
+	if (hi <= lo) {
+		hi += 1;
+		lo -= 1;
+	}
+
+	for (c = 0; c < cols; c++) {
+		int px = x + w - ((cols - c) * w) / width;
+
+		t->points[np].x = px;
+		t->points[np].y = y + (h -1) - (int)((t->columns[c].max - lo) * (h -1) / (hi - lo));
+		np++;
+		t->points[np].x = px;
+		t->points[np].y = y + (h -1) - (int)((t->columns[c].min - lo) * (h -1) / (hi - lo));
+		np++;
+	}
+
+	SDL_RenderDrawLines(renderer, t->points, np);
+
+	return 0;
+}
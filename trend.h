@@ -0,0 +1,51 @@
+/*
+ * Trend graph
+ *
+ * Scrolling strip chart of a meter's recent readings.  Samples
+ * go in to a preallocated min/max pyramid; level 0 holds single
+ * samples and each level above summarises TREND_FACTOR buckets
+ * of the one below.  Drawing picks the level that's closest to
+ * one bucket per pixel, so a graph spanning hours costs no more
+ * to draw than one spanning seconds; about two points per pixel
+ * column, all handed to SDL_RenderDrawLines() in one go.
+ *
+ */
+#ifndef __TREND_H__
+#define __TREND_H__
+
+#include <SDL.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TREND_LEVELS 4
+#define TREND_FACTOR 8
+#define TREND_LEVEL_SIZE 4096 // buckets kept per level, must be a power of two
+#define TREND_MAX_WIDTH 2048  // widest graph we'll draw, pixels
+
+struct trend_bucket_s {
+	float min, max;
+};
+
+struct trend_level_s {
+	struct trend_bucket_s b[TREND_LEVEL_SIZE];
+	uint64_t count; // buckets ever written here, newest is count-1
+
+	struct trend_bucket_s pending; // summary of the level below, filling up
+	int pending_n;
+};
+
+struct trend_s {
+	struct trend_level_s *levels;   // TREND_LEVELS of them
+	struct trend_bucket_s *columns; // drawing scratch, 1 per pixel column
+	SDL_Point *points;              // and 2 points per column
+	size_t span;                    // samples across the width of the graph, 0 = one per pixel
+};
+
+int trend_init( struct trend_s *t );
+void trend_free( struct trend_s *t );
+void trend_clear( struct trend_s *t );
+void trend_add( struct trend_s *t, double v );
+void trend_zoom( struct trend_s *t, int width, int out );
+int trend_draw( struct trend_s *t, SDL_Renderer *renderer, int x, int y, int w, int h );
+
+#endif
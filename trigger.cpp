@@ -0,0 +1,301 @@
+/*
+ * Trigger capture
+ *
+ * trigger_add() runs on the acquisition thread for every fresh
+ * reading from the watched meter.  The writer thread sleeps on a
+ * semaphore until a capture is complete, so the file work never
+ * holds up the meters.
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trigger.h"
+
+#define FL __FILE__,__LINE__
+
+static const struct {
+	const char *name;
+	int type;
+	int levels;
+} trigger_types[] = {
+	{ "above", TRIGGER_ABOVE, 1 },
+	{ "below", TRIGGER_BELOW, 1 },
+	{ "rise", TRIGGER_RISE, 1 },
+	{ "fall", TRIGGER_FALL, 1 },
+	{ "outside", TRIGGER_OUTSIDE, 2 },
+	{ "inside", TRIGGER_INSIDE, 2 },
+	{ "delta", TRIGGER_DELTA, 1 }
+};
+
+#define TRIGGER_TYPES (int)(sizeof(trigger_types) / sizeof(trigger_types[0]))
+
+/*
+ * Pick apart "type:level[:level],a=b,c"
+ *
+ */
+static int trigger_parse( struct trigger_s *t, const char *spec ) {
+	char buf[4096];
+	char *opt, *save = NULL, *p, *end;
+	int i, levels = 0;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	opt = strtok_r(buf, ",", &save);
+	if (!opt) return -1;
+
+	p = strchr(opt, ':');
+	if (p) *p++ = '\0';
+
+	t->type = -1;
+	for (i = 0; i < TRIGGER_TYPES; i++) {
+		if (strcmp(opt, trigger_types[i].name) == 0) {
+			t->type = trigger_types[i].type;
+			levels = trigger_types[i].levels;
+		}
+	}
+	if (t->type < 0) {
+		fprintf(stderr,"%s:%d: Unknown trigger type '%s'\r\n", FL, opt);
+		return -1;
+	}
+
+	if (!p) return -1;
+	t->lo = strtod(p, &end);
+	if (end == p) return -1;
+	if (levels == 2) {
+		if (*end != ':') return -1;
+		p = end +1;
+		t->hi = strtod(p, &end);
+		if (end == p) return -1;
+		if (t->hi < t->lo) {
+			double x = t->lo;
+			t->lo = t->hi;
+			t->hi = x;
+		}
+	}
+	if (*end) return -1;
+
+	for (opt = strtok_r(NULL, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(opt, '=');
+		if (val) *val++ = '\0';
+
+		if (strcmp(opt, "pre") == 0 && val) {
+			t->pre = atoi(val);
+		} else if (strcmp(opt, "post") == 0 && val) {
+			t->post = atoi(val);
+		} else if (strcmp(opt, "file") == 0 && val) {
+			snprintf(t->prefix, sizeof(t->prefix), "%s", val);
+		} else if (strcmp(opt, "meter") == 0 && val) {
+			t->meter = atoi(val);
+		} else if (strcmp(opt, "once") == 0) {
+			t->once = true;
+		} else {
+			fprintf(stderr,"%s:%d: Unknown trigger option '%s'\r\n", FL, opt);
+			return -1;
+		}
+	}
+
+	if ((t->pre < 0) || (t->pre > TRIGGER_MAX_SAMPLES) || (t->post < 0) || (t->post > TRIGGER_MAX_SAMPLES)) {
+		fprintf(stderr,"%s:%d: Trigger pre/post must be 0..%d readings\r\n", FL, TRIGGER_MAX_SAMPLES);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Save a finished capture as a sample log, in the next
+ * <prefix>-<n>.vlog that doesn't already exist.
+ *
+ */
+static void trigger_write( struct trigger_s *t ) {
+	struct samplelog_s l;
+	char fn[4096];
+	int i;
+
+	do {
+		snprintf(fn, sizeof(fn), "%s-%03d.vlog", t->prefix, ++t->file_index);
+	} while (access(fn, F_OK) == 0);
+
+	if (samplelog_open(&l, fn)) return;
+	for (i = 0; i < t->capture_n; i++) {
+		if (samplelog_append(&l, t->capture[i].t_ns, &t->capture[i].s)) break;
+	}
+	samplelog_close(&l);
+
+	stats_count(COUNT_TRIGGERS, 1);
+	fprintf(stderr,"Trigger: %d readings saved to '%s'\r\n", i, fn);
+}
+
+static void *trigger_thread( void *arg ) {
+	struct trigger_s *t = (struct trigger_s *)arg;
+
+	while (1) {
+		while ((sem_wait(&t->ready) != 0) && (errno == EINTR)) { /* signal, wait again */ }
+
+		if (t->state == TRIGGER_WRITING) {
+			trigger_write(t);
+			t->state = t->once ? TRIGGER_DONE : TRIGGER_ARMED;
+		}
+		if (t->quit) break;
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: trigger_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct trigger_s *t,
+  2. const char *spec, the -t argument
+  3. int meters, how many -p meters there are, for meter=n
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: allocates the buffers and starts the writer thread
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int trigger_start( struct trigger_s *t, const char *spec, int meters ) {
+	int err;
+
+	t->pre = TRIGGER_PRE_DEFAULT;
+	t->post = TRIGGER_POST_DEFAULT;
+	t->meter = 0;
+	t->once = false;
+	snprintf(t->prefix, sizeof(t->prefix), "trigger");
+
+	if (trigger_parse(t, spec)) {
+		fprintf(stderr,"%s:%d: Bad trigger '%s', expecting <type>:<level>[:<level>][,pre=n,post=n,file=prefix,meter=n,once]\r\n", FL, spec);
+		return -1;
+	}
+
+	if ((t->meter < 0) || (t->meter >= meters)) {
+		fprintf(stderr,"%s:%d: Trigger meter=%d, but there %s only %d -p meter%s ( meter=0..%d )\r\n", FL, t->meter, (meters == 1) ? "is" : "are", meters, (meters == 1) ? "" : "s", meters -1);
+		return -1;
+	}
+
+	t->ring = (struct samplelog_record_s *)calloc(t->pre +1, sizeof(struct samplelog_record_s));
+	t->capture = (struct samplelog_record_s *)calloc(t->pre + 1 + t->post, sizeof(struct samplelog_record_s));
+	if (!t->ring || !t->capture) {
+		fprintf(stderr,"%s:%d: Unable to allocate trigger buffers\r\n", FL);
+		return -1;
+	}
+	t->ring_count = 0;
+	t->have_last = false;
+	t->capture_n = 0;
+	t->file_index = 0;
+	t->state = TRIGGER_ARMED;
+	t->quit = false;
+
+	sem_init(&t->ready, 0, 0);
+	err = pthread_create(&t->tid, NULL, trigger_thread, t);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start trigger thread (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool trigger_fires( struct trigger_s *t, double v ) {
+	switch (t->type) {
+		case TRIGGER_ABOVE: return v > t->lo;
+		case TRIGGER_BELOW: return v < t->lo;
+		case TRIGGER_RISE: return t->have_last && (t->last_value < t->lo) && (v >= t->lo);
+		case TRIGGER_FALL: return t->have_last && (t->last_value > t->lo) && (v <= t->lo);
+		case TRIGGER_OUTSIDE: return (v < t->lo) || (v > t->hi);
+		case TRIGGER_INSIDE: return (v >= t->lo) && (v <= t->hi);
+		case TRIGGER_DELTA: return t->have_last && (fabs(v - t->last_value) >= t->lo);
+	}
+
+	return false;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: trigger_add
+  Returns Type	: void
+  ----Parameter List
+  1. struct trigger_s *t,
+  2. uint64_t t_ns, when the reading arrived, CLOCK_MONOTONIC
+  3. const struct sample_s *s, a fresh reading from t->meter
+  ------------------
+  Exit Codes	:
+  Side Effects	: wakes the writer thread when a capture is complete
+  --------------------------------------------------------------------
+Comments:
+	Overloads compare as +/- infinity, so an open circuit is
+	"above" any resistance.  Edge and delta triggers forget the
+	previous reading when the meter changes function, a step
+	from volts to ohms means nothing.
+
+\------------------------------------------------------------------*/
+void trigger_add( struct trigger_s *t, uint64_t t_ns, const struct sample_s *s ) {
+	struct samplelog_record_s rec;
+	int state = t->state;
+	size_t ring_size = t->pre +1;
+	bool fired;
+
+	rec.t_ns = t_ns;
+	sample_copy(&rec.s, s);
+
+	if (t->have_last && (s->mode != t->last_mode)) t->have_last = false;
+	fired = trigger_fires(t, s->value);
+
+	if (state == TRIGGER_POST) {
+		t->capture[t->capture_n++] = rec;
+		if (--t->post_left == 0) {
+			t->state = TRIGGER_WRITING;
+			sem_post(&t->ready);
+		}
+	} else if (fired && (state == TRIGGER_WRITING)) {
+		stats_count(COUNT_TRIGGERS_MISSED, 1);
+	} else if (fired && (state == TRIGGER_ARMED)) {
+		uint64_t n = (t->ring_count < (uint64_t)t->pre) ? t->ring_count : t->pre;
+		uint64_t i;
+
+		for (i = 0; i < n; i++) {
+			t->capture[i] = t->ring[(t->ring_count - n + i) % ring_size];
+		}
+		t->capture[n] = rec;
+		t->capture_n = n +1;
+		t->post_left = t->post;
+
+		if (t->post_left == 0) {
+			t->state = TRIGGER_WRITING;
+			sem_post(&t->ready);
+		} else {
+			t->state = TRIGGER_POST;
+		}
+	}
+
+	t->ring[t->ring_count % ring_size] = rec;
+	t->ring_count++;
+
+	t->last_value = s->value;
+	t->last_mode = s->mode;
+	t->have_last = true;
+}
+
+/*
+ * Any capture still collecting its post trigger readings is
+ * saved as it stands.  The acquisition thread must have
+ * stopped first.
+ *
+ */
+void trigger_stop( struct trigger_s *t ) {
+	if (t->state == TRIGGER_POST) t->state = TRIGGER_WRITING;
+	t->quit = true;
+	sem_post(&t->ready);
+	pthread_join(t->tid, NULL);
+
+	sem_destroy(&t->ready);
+	free(t->ring);
+	free(t->capture);
+}
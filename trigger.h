@@ -0,0 +1,91 @@
+/*
+ * Trigger capture
+ *
+ * Watches one meter's readings for a condition, the way a scope
+ * trigger does, and saves the readings either side of the moment
+ * it was met.  The last `pre` readings are always held in a ring;
+ * when the trigger fires they and the next `post` readings are
+ * copied out and handed to a writer thread, which saves them as
+ * a sample log (see vc8145-export).  All buffers are allocated up
+ * front, the acquisition side only ever copies records.
+ *
+ * -t <type>:<level>[:<level>][,pre=n,post=n,file=prefix,meter=n,once]
+ *
+ *   above:x / below:x      level, any reading past x
+ *   rise:x / fall:x        edge, a reading crossing x
+ *   outside:lo:hi          window, any reading outside lo..hi
+ *   inside:lo:hi           or inside it
+ *   delta:d                a step of at least d between readings
+ *
+ * Once a capture is saved the trigger re-arms (unless once), so
+ * a level that stays met keeps on saving captures.
+ *
+ */
+#ifndef __TRIGGER_H__
+#define __TRIGGER_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "samplelog.h"
+
+#define TRIGGER_PRE_DEFAULT 100
+#define TRIGGER_POST_DEFAULT 100
+#define TRIGGER_MAX_SAMPLES 1000000 // pre and post, each
+
+enum trigger_type {
+	TRIGGER_ABOVE,
+	TRIGGER_BELOW,
+	TRIGGER_RISE,
+	TRIGGER_FALL,
+	TRIGGER_OUTSIDE,
+	TRIGGER_INSIDE,
+	TRIGGER_DELTA
+};
+
+enum trigger_state {
+	TRIGGER_ARMED,
+	TRIGGER_POST,    // fired, collecting the readings after
+	TRIGGER_WRITING, // capture handed to the writer thread
+	TRIGGER_DONE     // once, and it has been
+};
+
+struct trigger_s {
+	int type;        // enum trigger_type
+	double lo, hi;   // level(s), lo only for single level types
+	int pre, post;   // readings kept either side
+	int meter;       // which -p meter we watch, from 0
+	bool once;       // stay disarmed after the first capture
+	char prefix[4000]; // captures go in <prefix>-<n>.vlog
+
+	/*
+	 * Acquisition thread only
+	 */
+	struct samplelog_record_s *ring; // last pre readings, and room for one more
+	uint64_t ring_count;             // readings ever put in ring
+	double last_value;
+	uint8_t last_mode;
+	bool have_last;
+	int post_left;
+
+	/*
+	 * Handed over to the writer
+	 */
+	struct samplelog_record_s *capture; // pre + 1 + post readings
+	int capture_n;
+	std::atomic<int> state; // enum trigger_state
+	int file_index;
+
+	sem_t ready;
+	std::atomic<bool> quit;
+	pthread_t tid;
+};
+
+int trigger_start( struct trigger_s *t, const char *spec, int meters );
+void trigger_add( struct trigger_s *t, uint64_t t_ns, const struct sample_s *s );
+void trigger_stop( struct trigger_s *t );
+
+#endif
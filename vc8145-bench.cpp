@@ -0,0 +1,344 @@
+/*
+ * VICI VC8145 decoder benchmark
+ *
+ * Times frame validation, decoding and display formatting over a
+ * corpus of frames; every function code and range the meter can
+ * send, both signs, overloads and blanked digits, plus the replies
+ * found in any capture files (-p replay: / capture dumps) given on
+ * the command line.  Reports ns/frame and heap allocations/frame,
+ * which should stay at zero.  Run with `make bench`.
+ *
+ * Also puts a long run of readings from two meters through the
+ * archive (-A) and back, and fails unless every one comes back
+ * exactly as it went in.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "capture.h"
+#include "decoder.h"
+
+#define FL __FILE__,__LINE__
+
+#define BENCH_ROUNDS 200
+#define BENCH_MAX_FRAMES (64 * 1024)
+#define BENCH_DIGIT_PATTERNS 8
+#define BENCH_ARCHIVE_READINGS 150000
+
+/*
+ * Count every heap allocation, glibc lets us wrap its own
+ *
+ */
+extern "C" {
+	void *__libc_malloc( size_t n );
+	void *__libc_calloc( size_t n, size_t size );
+	void *__libc_realloc( void *p, size_t n );
+	void __libc_free( void *p );
+}
+
+static volatile uint64_t allocations = 0;
+
+extern "C" void *malloc( size_t n ) { allocations++; return __libc_malloc(n); }
+extern "C" void *calloc( size_t n, size_t size ) { allocations++; return __libc_calloc(n, size); }
+extern "C" void *realloc( void *p, size_t n ) { allocations++; return __libc_realloc(p, n); }
+extern "C" void free( void *p ) { __libc_free(p); }
+
+static uint8_t frames[BENCH_MAX_FRAMES][DATA_FRAME_SIZE];
+static struct sample_s samples[BENCH_MAX_FRAMES];
+static int frame_count = 0;
+
+static uint64_t now_ns( void ) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_frame( const uint8_t *d ) {
+	if (frame_count < BENCH_MAX_FRAMES) memcpy(frames[frame_count++], d, DATA_FRAME_SIZE);
+}
+
+/*
+ * Every function (byte 1 bits 7:3), range (byte 2 bits 5:3) and
+ * autorange setting, with a spread of displays for each
+ *
+ */
+static void generate_frames( void ) {
+	static const char *patterns[BENCH_DIGIT_PATTERNS] = { "00000", "12345", "99999", "00042", "0L000", " 0L  ", "50000", "07071" };
+	int f, r, a, p, i;
+
+	for (f = 0; f < 32; f++) {
+		for (r = 0; r < 8; r++) {
+			for (a = 0; a < 2; a++) {
+				for (p = 0; p < BENCH_DIGIT_PATTERNS; p++) {
+					uint8_t d[DATA_FRAME_SIZE];
+
+					d[0] = DATA_FRAME_HEADER;
+					d[1] = f << 3;
+					d[2] = (r << 3) | (a ? MMFLAG_AUTORANGE : 0);
+					d[3] = 0;
+					d[4] = (p & 1) ? 0x50 : 0x40;
+					for (i = 0; i < 5; i++) d[5 +i] = (patterns[p][i] == 'L') ? 0x3E : patterns[p][i];
+					d[10] = 0;
+					d[11] = DATA_FRAME_TERMINATOR;
+					add_frame(d);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Pull the meter's replies out of a capture file
+ *
+ */
+static int load_capture( const char *filename ) {
+	struct capture_header_s h;
+	struct capture_chunk_s c;
+	uint8_t rx[DATA_FRAME_SIZE * 2];
+	size_t rx_len = 0;
+	int found = 0, i;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, filename, strerror(errno));
+		return -1;
+	}
+
+	if ((fread(&h, sizeof(h), 1, f) != 1) || (memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) != 0)) {
+		fprintf(stderr,"%s:%d: '%s' is not a capture file\r\n", FL, filename);
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(&c, sizeof(c), 1, f) == 1) {
+		uint8_t data[256];
+
+		if (fread(data, 1, c.len, f) != c.len) break;
+		if (c.dir != CAPTURE_DIR_RX) continue;
+
+		for (i = 0; i < c.len; i++) {
+			rx[rx_len++] = data[i];
+			if (rx_len < DATA_FRAME_SIZE) continue;
+			if (frame_valid(rx + rx_len - DATA_FRAME_SIZE)) {
+				add_frame(rx + rx_len - DATA_FRAME_SIZE);
+				found++;
+				rx_len = 0;
+			} else if (rx_len == sizeof(rx)) {
+				memmove(rx, rx + DATA_FRAME_SIZE, DATA_FRAME_SIZE);
+				rx_len = DATA_FRAME_SIZE;
+			}
+		}
+	}
+	fclose(f);
+
+	fprintf(stdout,"%s: %d frames\n", filename, found);
+
+	return 0;
+}
+
+/*
+ * Archive round trip.  The readings are made up on the fly from
+ * a seed, so the checking side can make the same ones again
+ * rather than keep them all.
+ *
+ */
+struct bench_archive_s {
+	uint32_t rng;
+	int count, meter_run, meter, step;
+	uint64_t t_ns;
+	struct sample_s s[2];
+	int mismatches;
+	int read;
+};
+
+static uint32_t bench_rand( struct bench_archive_s *b ) {
+	b->rng ^= b->rng << 13;
+	b->rng ^= b->rng >> 17;
+	b->rng ^= b->rng << 5;
+	return b->rng;
+}
+
+static void bench_archive_reset( struct bench_archive_s *b ) {
+	memset(b, 0, sizeof(struct bench_archive_s));
+	b->rng = 0x8145;
+	b->t_ns = 1000000000;
+	decode_frame(frames[0], &b->s[0]);
+	decode_frame(frames[1], &b->s[1]);
+}
+
+/*
+ * The next reading; mostly repeats (RUN) and small changes in
+ * the digits (STEP), now and then a different function, range
+ * or display (FULL), switching meters every so often (METER)
+ */
+static void bench_archive_next( struct bench_archive_s *b, struct samplelog_record_s *rec ) {
+	struct sample_s *s;
+	uint32_t r = bench_rand(b);
+
+	if (b->meter_run-- <= 0) {
+		b->meter ^= 1;
+		b->meter_run = r % 200;
+	}
+	s = &b->s[b->meter];
+
+	switch ((r >> 8) % 16) {
+		case 0:
+			decode_frame(frames[(r >> 12) % frame_count], s); // anything at all
+			break;
+		case 1: case 2: case 3: case 4:
+			{
+				int32_t n = 0;
+				int i;
+
+				for (i = 0; i < 5; i++) {
+					if ((s->digits[i] < '0') || (s->digits[i] > '9')) break;
+					n = n * 10 + (s->digits[i] - '0');
+				}
+				if (i < 5) break; // L or blanks, leave it be
+				n += (int32_t)((r >> 12) % 41) - 20;
+				if (n < 0) n = -n;
+				if (n > 99999) n = 99999;
+				snprintf(s->digits, sizeof(s->digits), "%04d", n / 10); // snprintf wants room for the \0
+				s->digits[4] = '0' + (n % 10);
+				sample_set_value(s);
+			}
+			break;
+		default: break; // the same again
+	}
+	s->meter = b->meter;
+
+	b->t_ns += 100000000 + (r >> 20) % 2000000; // 10/s with some jitter
+	memset(rec, 0, sizeof(struct samplelog_record_s));
+	rec->t_ns = b->t_ns;
+	rec->s = *s;
+	b->count++;
+}
+
+static bool bench_same( const struct sample_s *a, const struct sample_s *b ) {
+	return (memcmp(&a->value, &b->value, sizeof(a->value)) == 0)
+		&& (a->flags == b->flags) && (a->mode == b->mode) && (a->unit == b->unit)
+		&& (a->prefix == b->prefix) && (a->range == b->range) && (a->sign == b->sign)
+		&& (a->dp == b->dp) && (memcmp(a->digits, b->digits, sizeof(a->digits)) == 0)
+		&& (a->meter == b->meter);
+}
+
+static int bench_archive_check( void *ctx, const struct samplelog_record_s *got ) {
+	struct bench_archive_s *b = (struct bench_archive_s *)ctx;
+	struct samplelog_record_s want;
+
+	bench_archive_next(b, &want);
+	b->read++;
+	if ((got->t_ns != want.t_ns) || !bench_same(&got->s, &want.s)) {
+		if (b->mismatches++ < 5) fprintf(stderr,"%s:%d: Archive reading %d came back different\r\n", FL, b->read);
+	}
+
+	return 0;
+}
+
+static int bench_archive( void ) {
+	struct bench_archive_s b;
+	struct archive_s *a;
+	struct archive_reader_s r;
+	struct samplelog_record_s rec;
+	struct stat st;
+	char fn[64];
+	int i;
+
+	snprintf(fn, sizeof(fn), "/tmp/vc8145-bench-%d.varc", (int)getpid());
+	a = new archive_s; // the input ring is too big for the stack
+	if (archive_start(a, fn)) {
+		delete a;
+		return -1;
+	}
+
+	bench_archive_reset(&b);
+	for (i = 0; i < BENCH_ARCHIVE_READINGS; i++) {
+		bench_archive_next(&b, &rec);
+		while (!a->input.push(rec)) usleep(1000); // wait for the archive thread, nothing may be dropped
+	}
+	archive_stop(a);
+	delete a;
+
+	if (archive_reader_open(&r, fn)) {
+		unlink(fn);
+		return -1;
+	}
+	bench_archive_reset(&b);
+	archive_read(&r, 0, UINT64_MAX, bench_archive_check, &b);
+	archive_reader_close(&r);
+
+	if (stat(fn, &st) != 0) st.st_size = 0;
+	unlink(fn);
+
+	fprintf(stdout,"archive round trip: %d of %d readings back, %d different, %.2f bytes/reading\n"
+			, b.read, BENCH_ARCHIVE_READINGS, b.mismatches, (double)st.st_size / BENCH_ARCHIVE_READINGS);
+
+	return ((b.read == BENCH_ARCHIVE_READINGS) && (b.mismatches == 0)) ? 0 : -1;
+}
+
+int main( int argc, char **argv ) {
+	struct sample_s s;
+	char text[64];
+	uint64_t t0, t1, a0, checksum = 0;
+	double decode_ns, format_ns, decode_allocs, format_allocs;
+	int round, i, valid = 0;
+
+	generate_frames();
+	for (i = 1; i < argc; i++) {
+		if (load_capture(argv[i])) exit(1);
+	}
+
+	for (i = 0; i < frame_count; i++) {
+		if (frame_valid(frames[i])) valid++;
+	}
+	fprintf(stdout,"%d frames, %d valid, %d rounds\n", frame_count, valid, BENCH_ROUNDS);
+
+	/*
+	 * What the acquisition thread does with every reply
+	 */
+	a0 = allocations;
+	t0 = now_ns();
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		for (i = 0; i < frame_count; i++) {
+			if (frame_valid(frames[i]) && (decode_frame(frames[i], &s) == 0)) checksum += s.mode + s.digits[4];
+		}
+	}
+	t1 = now_ns();
+	decode_ns = (double)(t1 - t0) / ((double)frame_count * BENCH_ROUNDS);
+	decode_allocs = (double)(allocations - a0) / ((double)frame_count * BENCH_ROUNDS);
+
+	/*
+	 * and what the display does with each reading it shows,
+	 * plain and with -u
+	 */
+	for (i = 0; i < frame_count; i++) decode_frame(frames[i], &samples[i]);
+	a0 = allocations;
+	t0 = now_ns();
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		for (i = 0; i < frame_count; i++) {
+			checksum += sample_format(&samples[i], round & 1, text, sizeof(text));
+		}
+	}
+	t1 = now_ns();
+	format_ns = (double)(t1 - t0) / ((double)frame_count * BENCH_ROUNDS);
+	format_allocs = (double)(allocations - a0) / ((double)frame_count * BENCH_ROUNDS);
+
+	fprintf(stdout,"%-24s %10s %14s\n", "", "ns/frame", "allocs/frame");
+	fprintf(stdout,"%-24s %10.1f %14.3f\n", "frame_valid+decode_frame", decode_ns, decode_allocs);
+	fprintf(stdout,"%-24s %10.1f %14.3f\n", "sample_format", format_ns, format_allocs);
+	fprintf(stdout,"(checksum %lu)\n", (unsigned long)checksum);
+
+	if (bench_archive()) return 1;
+
+	return 0;
+}
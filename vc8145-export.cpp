@@ -0,0 +1,257 @@
+/*
+ * VICI VC8145 sample log export
+ *
+ * Reads a binary sample log written by vc8145-sdl2 -l, or a
+ * compressed archive from -A, and writes it out as CSV or one
+ * JSON object per line.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "decoder.h"
+#include "samplelog.h"
+
+#define FL __FILE__,__LINE__
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+void show_help(void) {
+	fprintf(stdout,"VC8145 sample log export\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" [-j] [-f <time>] [-t <time>] <log or archive file>\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-j: JSON lines output instead of CSV\r\n"
+			"\t-f <time>: from, unix time as in the time column\r\n"
+			"\t-t <time>: to\r\n"
+			"\r\n"
+			"\texample: vc8145-export -j capture.vlog > capture.json\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+/*
+ * Records come straight from disk, make sure they can't
+ * index outside of the decoder's tables.
+ *
+ */
+static bool record_sane( const struct samplelog_record_s *rec ) {
+	return (rec->s.mode < MODE_COUNT) && (rec->s.unit < UNIT_COUNT) && (rec->s.prefix < PREFIX_COUNT);
+}
+
+/*
+ * Where we are in the output, shared by both file types
+ *
+ */
+struct export_s {
+	bool json;
+	int version;        // of the sample log, archives have the meter in every record
+	uint64_t realtime_ns, mono_ns; // start of the capture
+	uint64_t from_ns, to_ns;       // CLOCK_MONOTONIC range wanted
+};
+
+static int export_record( void *ctx, const struct samplelog_record_s *rec ) {
+	struct export_s *x = (struct export_s *)ctx;
+	char display[64];
+	unsigned meter;
+	double t;
+
+	if ((rec->t_ns < x->from_ns) || (rec->t_ns > x->to_ns)) return 0;
+
+	/* version 1 logs only ever had the one meter */
+	meter = (x->version >= 2) ? rec->s.meter : 0;
+
+	t = (x->realtime_ns + (rec->t_ns - x->mono_ns)) / 1e9;
+	sample_format(&rec->s, 0, display, sizeof(display));
+
+	if (x->json) {
+		char value[32];
+
+		/* JSON has no infinity, overloads go out as null */
+		if (isinf(rec->s.value)) snprintf(value, sizeof(value), "null");
+		else snprintf(value, sizeof(value), "%.9g", rec->s.value);
+
+		fprintf(stdout,"{\"time\":%.6f,\"mono_ns\":%lu,\"meter\":%u,\"value\":%s,\"unit\":\"%s\",\"mode\":\"%s\",\"display\":\"%s\",\"flags\":%u}\n"
+				, t
+				, (unsigned long)rec->t_ns
+				, meter
+				, value
+				, sample_unit_name(&rec->s)
+				, sample_mode_name(&rec->s)
+				, display
+				, rec->s.flags
+				);
+	} else {
+		fprintf(stdout,"%.6f,%lu,%u,%.9g,%s,%s,\"%s\",%u\n"
+				, t
+				, (unsigned long)rec->t_ns
+				, meter
+				, rec->s.value
+				, sample_unit_name(&rec->s)
+				, sample_mode_name(&rec->s)
+				, display
+				, rec->s.flags
+				);
+	}
+
+	return 0;
+}
+
+/*
+ * -f / -t are in the same unix time as the time column,
+ * turn them in to the capture's monotonic clock
+ *
+ */
+static void export_range( struct export_s *x, double from, double to ) {
+	double start = x->realtime_ns / 1e9;
+
+	x->from_ns = 0;
+	x->to_ns = UINT64_MAX;
+	if ((from > 0) && (from > start)) x->from_ns = x->mono_ns + (uint64_t)((from - start) * 1e9);
+	if (to > 0) x->to_ns = (to > start) ? x->mono_ns + (uint64_t)((to - start) * 1e9) : 0;
+}
+
+static int export_archive( struct export_s *x, const char *filename, double from, double to ) {
+	struct archive_reader_s r;
+	int result;
+
+	if (archive_reader_open(&r, filename)) {
+		archive_reader_close(&r);
+		return -1;
+	}
+
+	x->version = SAMPLELOG_VERSION;
+	x->realtime_ns = r.h.start_realtime_ns;
+	x->mono_ns = r.h.start_mono_ns;
+	export_range(x, from, to);
+
+	result = archive_read(&r, x->from_ns, x->to_ns, export_record, x);
+	archive_reader_close(&r);
+
+	return result;
+}
+
+int main( int argc, char **argv ) {
+	const struct samplelog_header_s *h;
+	const struct samplelog_record_s *rec, *end;
+	struct export_s x;
+	struct stat st;
+	char *filename = NULL;
+	double from = 0, to = 0;
+	uint8_t *map;
+	int fd, i;
+
+	x.json = false;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			switch (argv[i][1]) {
+				case 'j': x.json = true; break;
+				case 'f':
+				case 't':
+					if (i +1 >= argc) {
+						fprintf(stdout,"Insufficient parameters; -%c <unix time>\n", argv[i][1]);
+						exit(1);
+					}
+					if (argv[i][1] == 'f') from = atof(argv[++i]);
+					else to = atof(argv[++i]);
+					break;
+				case 'h':
+				default:
+					show_help();
+					exit(1);
+			}
+		} else {
+			filename = argv[i];
+		}
+	}
+
+	if (!filename) {
+		show_help();
+		exit(1);
+	}
+
+	fd = open(filename, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) != 0)) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, filename, strerror(errno));
+		exit(1);
+	}
+
+	if ((size_t)st.st_size < sizeof(struct samplelog_header_s)) {
+		fprintf(stderr,"%s:%d: '%s' is too short to be a sample log\r\n", FL, filename);
+		exit(1);
+	}
+
+	map = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr,"%s:%d: Unable to map '%s' (%s)\r\n", FL, filename, strerror(errno));
+		exit(1);
+	}
+
+	if (!x.json) fprintf(stdout,"time,mono_ns,meter,value,unit,mode,display,flags\n");
+
+	/*
+	 * Archives (-A) are read a block at a time, only the
+	 * blocks in the time range wanted are decompressed
+	 *
+	 */
+	if (memcmp(map, ARCHIVE_MAGIC, strlen(ARCHIVE_MAGIC)) == 0) {
+		munmap(map, st.st_size);
+		close(fd);
+		return export_archive(&x, filename, from, to) ? 1 : 0;
+	}
+
+	h = (const struct samplelog_header_s *)map;
+	if (memcmp(h->magic, SAMPLELOG_MAGIC, sizeof(h->magic)) != 0) {
+		fprintf(stderr,"%s:%d: '%s' is not a sample log\r\n", FL, filename);
+		exit(1);
+	}
+	if ((h->version < 1) || (h->version > SAMPLELOG_VERSION) || (h->record_size != sizeof(struct samplelog_record_s))) {
+		fprintf(stderr,"%s:%d: '%s' is log version %d, this tool reads up to version %d\r\n", FL, filename, h->version, SAMPLELOG_VERSION);
+		exit(1);
+	}
+
+	x.version = h->version;
+	x.realtime_ns = h->start_realtime_ns;
+	x.mono_ns = h->start_mono_ns;
+	export_range(&x, from, to);
+
+	rec = (const struct samplelog_record_s *)(map + sizeof(struct samplelog_header_s));
+	end = rec + (st.st_size - sizeof(struct samplelog_header_s)) / sizeof(struct samplelog_record_s);
+
+	/*
+	 * A zero timestamp marks the end of what was committed
+	 *
+	 */
+	for (; (rec < end) && rec->t_ns; rec++) {
+		if (!record_sane(rec)) {
+			fprintf(stderr,"%s:%d: Corrupt record at offset %ld, stopping\r\n", FL, (long)((const uint8_t *)rec - map));
+			break;
+		}
+
+		export_record(&x, rec);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * VICI VC8145 decoder fuzz target
+ *
+ * libFuzzer entry point; every DATA_FRAME_SIZE window of the input
+ * is put through the same steps a reply from the meter goes
+ * through, and the results checked for consistency.  Built with
+ * ASan/UBSan by `make fuzz`, so any read outside the decoder's
+ * tables shows up as well as any broken invariant.
+ *
+ * Built with -DFUZZ_STANDALONE instead it just runs the files named
+ * on the command line, for replaying a crash without libFuzzer.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decoder.h"
+
+#define FL __FILE__,__LINE__
+
+static void fuzz_fail( const char *why, const uint8_t *d ) {
+	int i;
+
+	fprintf(stderr,"%s:%d: %s, frame", FL, why);
+	for (i = 0; i < DATA_FRAME_SIZE; i++) fprintf(stderr," %02x", d[i]);
+	fprintf(stderr,"\r\n");
+	abort();
+}
+
+static void fuzz_frame( const uint8_t *d ) {
+	struct sample_s s, again;
+	char text[64];
+	int len, i;
+
+	memset(&s, 0xA5, sizeof(s)); // anything decode_frame() leaves unset would show
+
+	if (decode_frame(d, &s) != 0) {
+		if (d[0] == DATA_FRAME_HEADER) fuzz_fail("decode_frame() refused a frame with a good header", d);
+		if (frame_valid(d)) fuzz_fail("frame_valid() passed a frame decode_frame() refused", d);
+		return;
+	}
+
+	if ((s.mode >= MODE_COUNT) || (s.unit >= UNIT_COUNT) || (s.prefix >= PREFIX_COUNT)) fuzz_fail("decoded sample out of range", d);
+	if ((s.sign < -1) || (s.sign > 1) || (s.dp < -1) || (s.dp > 4)) fuzz_fail("decoded sign or decimal point out of range", d);
+	if (frame_valid(d) && ((s.mode == MODE_UNKNOWN) || (s.sign == 0))) fuzz_fail("frame_valid() passed an unknown function or sign", d);
+
+	for (i = 0; i < 5; i++) {
+		char c = s.digits[i];
+		if (!(((c >= '0') && (c <= '9')) || (c == 'L') || (c == ' '))) fuzz_fail("decoded digit not 0-9, L or blank", d);
+	}
+	if (!(s.flags & SAMPLE_FLAG_OVERLOAD) && !isfinite(s.value)) fuzz_fail("value not finite without an overload", d);
+	if ((s.flags & SAMPLE_FLAG_OVERLOAD) && !isinf(s.value)) fuzz_fail("overload with a finite value", d);
+
+	/*
+	 * Rebuilding the value from the digits (as the archive
+	 * reader does) must give exactly the same answer
+	 */
+	again = s;
+	again.value = 0;
+	sample_set_value(&again);
+	if (memcmp(&again.value, &s.value, sizeof(s.value)) != 0) fuzz_fail("sample_set_value() disagrees with decode_frame()", d);
+
+	len = sample_format(&s, 0, text, sizeof(text));
+	if ((len < 0) || (len >= (int)sizeof(text))) fuzz_fail("sample_format() overflowed", d);
+	len = sample_format(&s, 1, text, sizeof(text));
+	if ((len < 0) || (len >= (int)sizeof(text))) fuzz_fail("sample_format() -u overflowed", d);
+
+	if (!sample_mode_name(&s) || !sample_unit_name(&s)) fuzz_fail("no mode or unit name", d);
+}
+
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size ) {
+	size_t i;
+
+	for (i = 0; i + DATA_FRAME_SIZE <= size; i++) fuzz_frame(data + i);
+
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main( int argc, char **argv ) {
+	static uint8_t buf[1024 * 1024];
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		size_t n;
+
+		if (!f) {
+			fprintf(stderr,"%s:%d: Unable to open '%s'\r\n", FL, argv[i]);
+			return 1;
+		}
+		n = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+
+		LLVMFuzzerTestOneInput(buf, n);
+		fprintf(stdout,"%s: %lu bytes ok\n", argv[i], (unsigned long)n);
+	}
+
+	return 0;
+}
+#endif
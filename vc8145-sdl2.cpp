@@ -11,11 +11,16 @@
 #include <SDL.h>
 #include <SDL_ttf.h>
 
+#include <atomic>
+
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -23,6 +28,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "archive.h"
+#include "atlas.h"
+#include "decoder.h"
+#include "meter.h"
+#include "output.h"
+#include "runstats.h"
+#include "samplelog.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include "wire.h"
+#include "trend.h"
+#include "trigger.h"
 
 #define FL __FILE__,__LINE__
 
@@ -39,31 +60,24 @@
 #define BUILD_DATE " "
 #endif
 
-#define SSIZE 1024
-
-#define INTERFRAME_SLEEP	200000 // 0.2 seconds
-
-#define DATA_FRAME_SIZE 12
-#define ee ""
-#define uu "\u00B5"
-#define kk "k"
-#define MM "M"
-#define mm "m"
-#define nn "n"
-#define pp "p"
-#define dd "\u00B0"
-#define oo "\u03A9"
+/*
+ * Build with FAKE_SERIAL=1 to have the meter simulator
+ * as the default device, handy when there's no meter about.
+ *
+ */
+#ifndef FAKE_SERIAL
+#define FAKE_SERIAL 0
+#endif
 
-#define MMFLAG_AUTORANGE	0b01000000
+#define SSIZE 1024
 
-char SEPARATOR_DP[] = ".";
+#define UI_FRAME_MS 16 // display refresh tick, ~60Hz
+#define UI_IDLE_MS 250 // longest the window waits for an event, so quit is still noticed
 
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
+#define UI_FONT_FILE "RobotoMono-Regular.ttf"
+#define UI_FONT_MIN 10  // the window scales the reading's font size
+#define UI_FONT_MAX 320 // between these,
+#define UI_FONT_STEP 4  // in steps of this, so dragging the window doesn't rasterise every size
 
 struct meter_param {
 	char mode[20];
@@ -73,16 +87,40 @@ struct meter_param {
 };
 
 struct glb {
+	std::atomic<bool> quit;
 	uint8_t debug;
 	uint8_t quiet;
 	uint8_t show_mode;
+	uint8_t show_graph;
+	uint8_t headless;
 	uint16_t flags;
 	uint8_t range_control;
+	uint8_t low_latency;
 	uint8_t units_separator;
 	char *com_address;
 	char *output_file;
-
-	struct serial_params_s serial_params;
+	char *log_file;
+	char *archive_file;
+	char *server_address;
+	char *metrics_address;
+	char *stats_windows; // -a, NULL for no running statistics
+	char *trigger_spec;  // -t
+	char *wire_spec;     // -W
+	double sample_rate; // readings per second, 0 = max rate
+
+	struct meter_s meters[METER_MAX]; // one per -p, in order
+	int meter_count;
+
+	struct samplelog_s samplelog; // only touched by the acquisition thread
+	struct archive_s archive;
+	struct output_s output;       // FlexBV only ever sees the first meter
+	struct server_s server;
+	struct metrics_s metrics;
+	struct trigger_s trigger;
+
+	std::atomic<uint32_t> ui_event; // SDL user event for new readings, 0 until the window is up
+	std::atomic<bool> ui_woken;     // one is already queued, don't post another
+	std::atomic<int> ui_posting;    // acquisition thread is in SDL_PushEvent(), see run_window()
 
 	int font_size;
 	int window_width, window_height;
@@ -100,42 +138,6 @@ struct glb {
  */
 struct glb *glbs;
 
-/*
- * Test to see if a file exists
- *
- * Does not test anything else such as read/write status
- *
- */
-bool fileExists(const char *filename) {
-	struct stat buf;
-	return (stat(filename, &buf) == 0);
-}
-
-
-char digit( unsigned char dg ) {
-
-	int d;
-	char g;
-
-	switch (dg) {
-		case 0x30: g = '0'; d = 0; break;
-		case 0x31: g = '1'; d = 1; break;
-		case 0x32: g = '2'; d = 2; break;
-		case 0x33: g = '3'; d = 3; break;
-		case 0x34: g = '4'; d = 4; break;
-		case 0x35: g = '5'; d = 5; break;
-		case 0x36: g = '6'; d = 6; break;
-		case 0x37: g = '7'; d = 7; break;
-		case 0x38: g = '8'; d = 8; break;
-		case 0x39: g = '9'; d = 9; break;
-		case 0x3E: g = 'L'; d = 0; break;
-		case 0x3F: g = ' '; d = 0; break;
-		default: g = ' ';
-	}
-
-	return g;
-}
-
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
   Function Name	: init
@@ -153,13 +155,28 @@ Changes:
 
 \------------------------------------------------------------------*/
 int init(struct glb *g) {
+	g->quit = false;
 	g->debug = 0;
 	g->quiet = 0;
 	g->flags = 0;
 	g->range_control = 0;
+	g->low_latency = 0;
 	g->units_separator = 0;
 	g->com_address = NULL;
 	g->output_file = NULL;
+	g->log_file = NULL;
+	g->archive_file = NULL;
+	g->server_address = NULL;
+	g->metrics_address = NULL;
+	g->stats_windows = NULL;
+	g->trigger_spec = NULL;
+	g->wire_spec = NULL;
+	g->meter_count = 0;
+	g->sample_rate = 0;
+
+	g->ui_event = 0;
+	g->ui_woken = false;
+	g->ui_posting = 0;
 
 	g->font_size = 60;
 	g->window_width = 400;
@@ -168,6 +185,8 @@ int init(struct glb *g) {
 	g->wy_forced = 0;
 
 	g->show_mode = 0;
+	g->show_graph = 0;
+	g->headless = 0;
 	g->font_color =  { 10, 200, 10 };
 	g->background_color = { 0, 0, 0 };
 
@@ -183,17 +202,36 @@ void show_help(void) {
 			"\r\n"
 			"\t-h: This help\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t              repeat -p for more meters, shown tiled in one window\r\n"
+			"\t              or sim[:seed=n,mode=vdc|cycle|..,script=file,fast] for a simulated meter\r\n"
+			"\t              or replay:<capture>[,speed=x,loop] to play back a capture\r\n"
 			"\t-o <output file> ( used by FlexBV to read the data )\r\n"
+			"\t-l <log file> ( binary log of every reading, see vc8145-export )\r\n"
+			"\t-A <archive file> ( compressed log of every reading for long runs, see vc8145-export )\r\n"
+			"\t-S <unix:path | tcp:port> ( stream live readings to local clients )\r\n"
+			"\t-t <type>:<level>[:<level>][,pre=n,post=n,file=prefix,meter=n,once]\r\n"
+			"\t              save the readings around a trigger, type is above, below, rise, fall,\r\n"
+			"\t              outside, inside ( lo:hi ) or delta; see vc8145-export\r\n"
+			"\t-W <prefix>[,<seconds>] ( dump the last 30s of raw serial traffic on a bad or missing reply,\r\n"
+			"\t              as <prefix>-<meter>-<n>.vcap for -p replay:; SIGUSR2 dumps it any time )\r\n"
+			"\t-M <tcp:port> ( Prometheus metrics, timings are also dumped on SIGUSR1 and at exit )\r\n"
 			"\t-m: show mode on screen\r\n"
+			"\t-g: show a trend graph under each reading, up/down arrows zoom out/in\r\n"
+			"\t-a <seconds[,seconds...]>: running min/max/mean/sd and averages over these windows,\r\n"
+			"\t              shown under the reading and written to <output file>.stats with -o\r\n"
+			"\t--headless: no window, just acquisition and the -o/-l/-S outputs\r\n"
 			"\t-u: use Units as the separator ( 8.09K becomes 8R09 )\r\n"
-			"\t-d: debug enabled\r\n"
+			"\t-d: debug enabled, traces serial traffic and request to reply times to stderr\r\n"
+			"\t-L: low latency serial, no adapter buffering and one wakeup per reply\r\n"
 			"\t-q: quiet output\r\n"
 			"\t-v: show version\r\n"
-			"\t-z <font size in pt>\r\n"
+			"\t-sr <readings per second, 0 = max rate (default)>\r\n"
+			"\t-z <font size in pt, for the starting window size; resizing the window rescales it>\r\n"
 			"\t-fc <foreground colour, f0f0ff>\r\n"
 			"\t-bc <background colour, 101010>\r\n"
 			"\r\n"
 			"\t-r: Range control (VDC, VC8145 only)\r\n"
+			"\t    click a meter's reading to step its range manually\r\n"
 			"\r\n"
 			"\texample: vc8145-sdl -m -p /dev/ttyUSB0\r\n"
 			, BUILD_VER
@@ -233,6 +271,10 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 			/* parameter */
 			switch (argv[i][1]) {
 
+				case '-':
+					if (strcmp(argv[i], "--headless") == 0) g->headless = 1;
+					break;
+
 				case 'h':
 					show_help();
 					exit(1);
@@ -252,10 +294,17 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					/*
 					 * com port can be multiple things in linux
 					 * such as /dev/ttySx or /dev/ttyUSBxx
+					 *
+					 * Give -p more than once to run a bank of
+					 * meters from the one process.
 					 */
 					i++;
 					if (i < argc) {
-						g->serial_params.device = argv[i];
+						if (g->meter_count == METER_MAX) {
+							fprintf(stdout,"Too many meters, at most %d -p devices\n", METER_MAX);
+							exit(1);
+						}
+						g->meters[g->meter_count++].device = argv[i];
 					} else {
 						fprintf(stdout,"Insufficient parameters; -p <com port>\n");
 						exit(1);
@@ -277,8 +326,113 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					}
 					break;
 
+				case 'l':
+					/*
+					 * Binary log of every sample taken, for long
+					 * unattended captures
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->log_file = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -l <log file>\n");
+						exit(1);
+					}
+					break;
+
+				case 'A':
+					/*
+					 * Compressed log, for soak tests that run
+					 * for days
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->archive_file = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -A <archive file>\n");
+						exit(1);
+					}
+					break;
+
+				case 'S':
+					/*
+					 * Live readings for other tools on this machine
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->server_address = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -S <unix:path | tcp:port>\n");
+						exit(1);
+					}
+					break;
+
+				case 'a':
+					/*
+					 * Running statistics, with exponential averages
+					 * over each of the given windows
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->stats_windows = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -a <seconds[,seconds...]>\n");
+						exit(1);
+					}
+					break;
+
+				case 't':
+					/*
+					 * Trigger capture, like a scope's single shot
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->trigger_spec = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -t <type>:<level>[,pre=n,post=n,file=prefix]\n");
+						exit(1);
+					}
+					break;
+
+				case 'W':
+					/*
+					 * Where wire captures go, and dump one
+					 * whenever a frame is rejected
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->wire_spec = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -W <prefix>[,<seconds>]\n");
+						exit(1);
+					}
+					break;
+
+				case 'M':
+					/*
+					 * Timing histograms and counters for a
+					 * Prometheus scraper
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->metrics_address = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -M <tcp:port>\n");
+						exit(1);
+					}
+					break;
+
 				case 'd': g->debug = 1; break;
 
+				case 'L': g->low_latency = 1; break;
+
 				case 'q': g->quiet = 1; break;
 
 				case 'v':
@@ -323,6 +477,10 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 g->show_mode = 1;
 							 break;
 
+				case 'g':
+							 g->show_graph = 1;
+							 break;
+
 				case 'r':
 							 g->range_control = 1;
 							 break;
@@ -332,6 +490,17 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 break;
 
 				case 's':
+							 if (argv[i][2] == 'r') {
+								 i++;
+								 if (i < argc) {
+									 g->sample_rate = atof(argv[i]);
+									 if (g->sample_rate < 0) g->sample_rate = 0;
+								 } else {
+									 fprintf(stdout,"Insufficient parameters; -sr <readings per second>\n");
+									 exit(1);
+								 }
+								 break;
+							 }
 							 // Not needed, we hard code at 9600-8n1 because
 							 // that's what these meters should be doing.  
 							 //
@@ -350,142 +519,355 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 
 /*
+ * Convert ASCII to hex (uint)
  *
- * Open serial port for communitcations
+ */
+uint8_t a2h( uint8_t a ) {
+	a -= 0x30;
+	if (a < 10) return a;
+	a -= 7;
+	return a;
+}
+
+/*
+ * Hand a reading on to whoever wants it.  Everything is
+ * stamped from the one monotonic clock, at the time the
+ * frame's bytes came in, so readings from different
+ * meters line up against each other.
  *
  */
-void open_port(struct serial_params_s *s) {
-	int r; 
+static void acquire_publish( struct glb *g, struct meter_s *m, struct reading_s *r ) {
+	if (!(r->s.flags & SAMPLE_FLAG_STALE)) {
+		uint64_t t_ns = m->rx_ns;
+		if (g->stats_windows) runstats_add(&m->runstats, &r->s, t_ns);
+		if (g->log_file) samplelog_append(&g->samplelog, t_ns, &r->s);
+		if (g->archive_file) archive_append(&g->archive, t_ns, &r->s);
+		if (g->output_file && (m->index == 0)) {
+			output_publish(&g->output, &r->s);
+			if (g->stats_windows) output_publish_stats(&g->output, &m->runstats);
+		}
+		if (g->server_address) server_publish(&g->server, t_ns, &r->s);
+		if (g->trigger_spec && (m->index == g->trigger.meter)) trigger_add(&g->trigger, t_ns, &r->s);
+	}
+	if (g->stats_windows) r->rs = m->runstats;
 
-	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
+	if (!m->readings.push(*r)) {
+		m->readings_dropped++;
+		stats_count(COUNT_READINGS_DROPPED, 1);
 	}
 
-	fcntl(s->fd,F_SETFL,0);
-	//	fcntl(s->fd,F_SETFL,FNDELAY);
-
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	s->newtp.c_cflag = B9600 | CS8 | CLOCAL | CREAD; // Adjust the settings to suit our meter
-	s->newtp.c_cflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
-	s->newtp.c_cflag &= ~(PARENB | PARODD); // shut off parity
-	s->newtp.c_cflag &= ~CSTOPB; 
-	s->newtp.c_cflag &= ~CRTSCTS;
-
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
+	/*
+	 * Wake the window; one event until it's been handled,
+	 * however many readings and meters there are.  ui_posting
+	 * is raised before ui_event is looked at, so once the window
+	 * has cleared ui_event and seen ui_posting at 0 nothing can
+	 * still be on its way in to SDL.
+	 */
+	g->ui_posting++;
+	{
+		uint32_t ev = g->ui_event;
+
+		if (ev && !g->ui_woken.exchange(true)) {
+			SDL_Event e;
+
+			memset(&e, 0, sizeof(e));
+			e.type = ev;
+			if (SDL_PushEvent(&e) != 1) g->ui_woken = false;
+		}
 	}
+	g->ui_posting--;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: acquire_thread
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg, struct glb *
+  ------------------
+  Exit Codes	:
+  Side Effects	: pushes decoded readings on to each meter's readings queue
+  --------------------------------------------------------------------
+Comments:
+	Serial I/O and frame decoding for every meter run here, on
+	one epoll loop, at whatever pace each meter and its
+	scheduler allow.  A slow or silent meter only costs a
+	timeout on its own state machine, the others carry on.
+
+	Nothing in here touches SDL beyond posting the window an
+	event to say there's something new, and the UI never waits
+	on us; it just takes the newest reading off each queue when
+	it's ready to draw.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+void *acquire_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+	struct epoll_event events[METER_MAX];
+	int epoll_fd;
+	int i;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create epoll instance (%s)\r\n", FL, strerror(errno));
+		g->quit = true;
+		return NULL;
+	}
+
+	for (i = 0; i < g->meter_count; i++) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &g->meters[i];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g->meters[i].serial_params.fd, &ev) < 0) {
+			fprintf(stderr,"%s:%d: Unable to watch %s (%s)\r\n", FL, g->meters[i].device, strerror(errno));
+			g->quit = true;
+		}
+	}
+
+	while (!g->quit) {
+		int timeout = SCHED_IDLE_MS;
+		int n;
+
+		/*
+		 * Sleep until some meter has input, or the soonest
+		 * request / reply timeout, napping no longer than
+		 * SCHED_IDLE_MS so a quit request is still noticed
+		 * promptly.
+		 *
+		 */
+		for (i = 0; i < g->meter_count; i++) {
+			int t = meter_timeout_ms(&g->meters[i]);
+			if (t < timeout) timeout = t;
+		}
+
+		n = epoll_wait(epoll_fd, events, METER_MAX, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"%s:%d: epoll_wait failed (%s)\r\n", FL, strerror(errno));
+			g->quit = true;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct meter_s *m = (struct meter_s *)events[i].data.ptr;
+
+			if (meter_drain(m) < 0) {
+				fprintf(stderr,"%s:%d: Error reading from %s (%s)\r\n", FL, m->device, strerror(errno));
+				g->quit = true;
+			}
+		}
+
+		for (i = 0; i < g->meter_count; i++) {
+			struct meter_s *m = &g->meters[i];
+			struct reading_s r;
+
+			wire_poll(&m->wire);
+			while (meter_service(m, &r)) acquire_publish(g, m, &r);
+		}
+
+	} // while(!quit)
+
+	close(epoll_fd);
+
+	return NULL;
+}
+
+
 /*
- * Convert ASCII to hex (uint)
+ * SIGINT / SIGTERM, ask everything to wind down so the
+ * log gets trimmed and the server socket removed.
  *
  */
-uint8_t a2h( uint8_t a ) {
-	a -= 0x30;
-	if (a < 10) return a;
-	a -= 7;
-	return a;
+void quit_handler( int sig ) {
+	if (glbs) glbs->quit = true;
 }
 
 /*
- * Send single byte command to the meter
+ * SIGUSR1, the display loop (window or headless) prints the
+ * timings next time round, so a slow stderr never holds up
+ * the acquisition thread
  *
  */
-size_t cmd_send( struct glb *g, uint8_t cmd ) {
-	size_t bytes_written = 0;
+void stats_handler( int sig ) {
+	stats.dump_requested = true;
+}
 
-	bytes_written = write(g->serial_params.fd, &cmd, 1);
+/*
+ * SIGUSR2, every meter's wire capture is dumped next time
+ * the acquisition thread goes round its loop
+ *
+ */
+void wire_handler( int sig ) {
+	wire_request_dump();
+}
+
+/*
+ * A reading as it goes on screen; when the meter's last reply
+ * was no good we're still showing the one before, with a ?
+ *
+ */
+static void reading_text( struct glb *g, struct reading_s *r, char *buf, size_t len ) {
+	int n;
 
-	return bytes_written;
+	n = sample_format(&r->s, g->units_separator, buf, len);
+	if ((r->s.flags & SAMPLE_FLAG_STALE) && (n > 0) && ((size_t)n +1 < len)) {
+		buf[n] = '?';
+		buf[n +1] = '\0';
+	}
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: run_headless
+  Returns Type	: int
+  ----Parameter List
+  1. struct glb *g ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	No display at all; SDL and TTF are never touched.  The
+	acquisition, log, output and server threads do all the work,
+	we just keep the console line up to date until told to quit.
+
+\------------------------------------------------------------------*/
+int run_headless( struct glb *g ) {
+	struct reading_s r[METER_MAX];
+	bool have_reading[METER_MAX] = { false };
+
+	while (!g->quit) {
+		bool changed = false;
+		int i;
+
+		if (stats.dump_requested.exchange(false)) stats_dump(stderr);
+
+		for (i = 0; i < g->meter_count; i++) {
+			if (g->meters[i].readings.pop_latest(r[i])) have_reading[i] = changed = true;
+		}
+
+		if (changed && !g->quiet) {
+			for (i = 0; i < g->meter_count; i++) {
+				char value[SSIZE] = "";
 
+				if (have_reading[i]) reading_text(g, &r[i], value, sizeof(value));
+				if (g->meter_count == 1) {
+					char st[SSIZE] = "";
+					if (g->stats_windows && have_reading[i]) runstats_format(&r[i].rs, 0, st, sizeof(st));
+					fprintf(stdout,"%-40s%6.1f/s  %-40s", value, r[i].rate, st);
+				}
+				else fprintf(stdout,"%s%-12s", i ? "| " : "", value);
+			}
+			fprintf(stdout,"\r");
+			fflush(stdout);
+		}
+		usleep(UI_FRAME_MS * 1000);
+	}
+
+	return 0;
+}
 
 /*
- * Read single byte from serial port.
+ * One meter's share of the window
  *
- * Could be generalised to bytes_read() but for
- * now this serves the purpose it's used for.
+ */
+struct tile_s {
+	struct reading_s r;  // Most recent reading from the acquisition thread
+	bool have_reading;
+	char shown_value[SSIZE]; // what's currently on screen
+	char shown_line2[SSIZE];
+	char shown_stats[2][SSIZE]; // -a
+	struct trend_s trend;    // -g, every fresh reading
+};
+
+/*
+ * Where everything goes in the window at its current size
+ *
+ */
+struct layout_s {
+	int base_width, base_height; // a tile's reading at -z, the window scales from here
+	int tile_width, tile_height, text_height;
+	int font_size;
+};
+
+/*
+ * Share the window out between the meters and scale the font so
+ * the reading fills its part.  Sizes go in UI_FONT_STEP steps
+ * either side of -z, so the size we started at is always -z.
  *
  */
-size_t byte_read( struct glb *g ) {
-	uint8_t b = 0;
-	size_t bytes_read;
+static void window_layout( struct glb *g, struct layout_s *l, int width, int height ) {
+	double scale, sy;
 
-	bytes_read = read(g->serial_params.fd, &b, 1);
+	l->tile_width = width;
+	l->tile_height = height / g->meter_count;
+	l->text_height = g->show_graph ? l->tile_height / 2 : l->tile_height;
 
-	return b;
-}
+	scale = (double)l->tile_width / l->base_width;
+	sy = (double)l->text_height / l->base_height;
+	if (sy < scale) scale = sy;
 
+	l->font_size = g->font_size + (int)lround((g->font_size * scale - g->font_size) / UI_FONT_STEP) * UI_FONT_STEP;
+	if (l->font_size < UI_FONT_MIN) l->font_size = UI_FONT_MIN;
+	if (l->font_size > UI_FONT_MAX) l->font_size = UI_FONT_MAX;
+}
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20180127-220307
-  Function Name	: main
+  Function Name	: run_window
   Returns Type	: int
   ----Parameter List
-  1. int argc,
-  2.  char **argv ,
+  1. struct glb *g ,
   ------------------
-  Exit Codes	:
+  Exit Codes	: 0 on normal exit, 1 if the display couldn't be set up
   Side Effects	:
   --------------------------------------------------------------------
 Comments:
+	SDL display loop.  Readings are already flowing by the time
+	we get here, so font loading etc doesn't hold up the meter.
 
---------------------------------------------------------------------
-Changes:
+	Each meter gets a tile of its own, stacked top to bottom in
+	-p order.  -wx/-wy set the size of a tile.  With -g the tile
+	is twice the height, the trend graph filling the lower half.
 
-\------------------------------------------------------------------*/
-int main ( int argc, char **argv ) {
+	The window can be resized; the tiles share out whatever
+	space there is and the reading is redrawn at the font size
+	that fits.  Each size is rasterised the first time it's
+	wanted and kept in the atlas cache, all on this thread, so
+	acquisition carries on regardless.
 
+\------------------------------------------------------------------*/
+int run_window( struct glb *g ) {
 	SDL_Event event;
-	SDL_Surface *surface, *surface_2;
-	SDL_Texture *texture, *texture_2;
-
-	char linetmp[SSIZE]; // temporary string for building main line of text
-	char prefix[SSIZE]; // Units prefix u, m, k, M etc
-	char units[SSIZE];  // Measurement units F, V, A, R
-	char mmmode[SSIZE]; // Multimeter mode, Resistance/diode/cap etc
-
-	uint8_t d[SSIZE];
-	uint8_t dt[SSIZE];      // Serial data packet
-	int dt_loaded = 0;	// set when we have our first valid data
-	uint8_t dps = 0;     // Number of decimal places
-	struct glb g;        // Global structure for passing variables around
-	int i = 0;           // Generic counter
-	char temp_char;        // Temporary character
-	char tfn[4096];
-	bool quit = false;
-
-	glbs = &g;
-
-	/*
-	 * Initialise the global structure
-	 */
-	init(&g);
+	struct atlas_cache_s atlases;
+	struct atlas_s *atlas, *atlas_small;
+	int atlas_size; // font size atlas and atlas_small are for
+	struct tile_s tiles[METER_MAX];
+	struct layout_s l;
+	SDL_Window *window = NULL;
+	SDL_Renderer *renderer = NULL;
+	TTF_Font *font;
+	bool redraw = true;
+	bool visible;
+	int result = 1;
+	int i;
 
-	/*
-	 * Parse our command line parameters
-	 */
-	parse_parameters(&g, argc, argv);
+	for (i = 0; i < g->meter_count; i++) {
+		tiles[i].trend.levels = NULL; // trend_free() is safe from here on
+		tiles[i].trend.columns = NULL;
+		tiles[i].trend.points = NULL;
+		tiles[i].have_reading = false;
+		tiles[i].shown_value[0] = '\0';
+		tiles[i].shown_line2[0] = '\0';
+		tiles[i].shown_stats[0][0] = tiles[i].shown_stats[1][0] = '\0';
+	}
 
 	/* 
 	 * check paramters
 	 *
 	 */
-	if (g.font_size < 10) g.font_size = 10;
-	if (g.font_size > 200) g.font_size = 200;
-
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
-
-	/*
-	 * Handle the COM Port
-	 */
-	open_port(&g.serial_params);
+	if (g->font_size < 10) g->font_size = 10;
+	if (g->font_size > 200) g->font_size = 200;
 
 	/*
 	 * Setup SDL2 and fonts
@@ -494,8 +876,12 @@ int main ( int argc, char **argv ) {
 
 	SDL_Init(SDL_INIT_VIDEO);
 	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
-	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size/4);
+	atlas_cache_init(&atlases, UI_FONT_FILE, g->font_color);
+	font = TTF_OpenFont(UI_FONT_FILE, g->font_size);
+	if (!font) {
+		fprintf(stderr,"Error trying to open font :( \r\n");
+		goto done;
+	}
 
 	/*
 	 * Get the required window size.
@@ -503,381 +889,373 @@ int main ( int argc, char **argv ) {
 	 * Parameters passed can override the font self-detect sizing
 	 *
 	 */
-	TTF_SizeText(font, "-12.34mV  ", &g.window_width, &g.window_height);
-	if (g.wx_forced) g.window_width = g.wx_forced;
-	if (g.wy_forced) g.window_height = g.wy_forced;
-
-	SDL_Window *window = SDL_CreateWindow("VC8145", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
-	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
-	if (!font) {
-		fprintf(stderr,"Error trying to open font :( \r\n");
-		exit(1);
+	TTF_SizeText(font, "-12.34mV  ", &l.base_width, &l.base_height);
+	TTF_CloseFont(font);
+	if (g->wx_forced) l.base_width = g->wx_forced;
+	if (g->wy_forced) l.base_height = g->wy_forced;
+	if (g->show_graph) {
+		for (i = 0; i < g->meter_count; i++) {
+			if (trend_init(&tiles[i].trend)) goto done;
+		}
 	}
+	g->window_width = l.base_width;
+	g->window_height = l.base_height * (g->show_graph ? 2 : 1) * g->meter_count;
+	window_layout(g, &l, g->window_width, g->window_height);
+
+	window = SDL_CreateWindow("VC8145", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g->window_width, g->window_height, SDL_WINDOW_RESIZABLE);
+	if (window) renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+	if (!renderer) {
+		fprintf(stderr,"%s:%d: Unable to create window (%s)\r\n", FL, SDL_GetError());
+		goto done;
+	}
+	visible = !(SDL_GetWindowFlags(window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED));
+	SDL_SetWindowMinimumSize(window, g->window_width * UI_FONT_MIN / g->font_size, g->window_height * UI_FONT_MIN / g->font_size);
+
+	/*
+	 * Rasterise what we'll draw at the starting size up front,
+	 * other sizes as the window is resized
+	 *
+	 */
+	atlas = atlas_cache_get(&atlases, renderer, l.font_size);
+	atlas_small = atlas_cache_get(&atlases, renderer, l.font_size / 4);
+	if (!atlas || !atlas_small) goto done;
+	atlas_size = l.font_size;
 
 	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255 );
+	SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255 );
 
 	/* Clear the entire screen to our selected color. */
 	SDL_RenderClear(renderer);
 
+	/*
+	 * From here on the acquisition thread tells us when there's
+	 * a new reading; if SDL has no user events left we look for
+	 * them every display tick instead.
+	 *
+	 */
+	{
+		uint32_t ev = SDL_RegisterEvents(1);
+		if (ev != (uint32_t)-1) g->ui_event = ev;
+	}
+
 	/*
 	 *
 	 * Parent will terminate us... else we'll become a zombie
 	 * and hope that the almighty PID 1 will reap us
 	 *
 	 */
-	while (!quit) {
-		char line1[1024];
-		char line2[1024];
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		uint8_t range;
-		uint8_t dpp = 0;
-		ssize_t bytes_read = 0;
-		bool units_override = false;
-
-		while (SDL_PollEvent(&event)) {
-			switch (event.type)
-			{
-				case SDL_KEYDOWN:
-					if (event.key.keysym.sym == SDLK_q) quit = true;
-					break;
-				case SDL_QUIT:
-					quit = true;
-					break;
-			}
-		}
-
-		linetmp[0] = '\0';
+	while (!g->quit) {
+		char value[METER_MAX][SSIZE]; // formatted reading
+		char line2[METER_MAX][1024];
+		char stats_text[METER_MAX][2][SSIZE]; // -a
+		bool changed = false;
 
 		/*
-		 * Time to start receiving the serial block data
-		 *
-		 * We initially "stage" here waiting for there to
-		 * be something happening on the com port.  Soon as
-		 * something happens, then we move forward to trying
-		 * to read the data.
-		 *
-		 * Send code 0x89 which requests  the main display data
-		 * and includes the device state in bytes [1:3]
-		 * byte 4 contains sign/range/hold
+		 * Sleep until something happens; a reading, input, or
+		 * the window system wanting us.  Then handle everything
+		 * that's queued, so a burst of events is one repaint.
 		 *
 		 */
-		{
-			size_t bytes_written = 0;
-			bytes_written = cmd_send(&g, 0x89);
-			if (bytes_written == 0) continue;
-		}
-
-		if (g.debug) { fprintf(stderr,"DATA START: "); }
-		end_of_frame_received = 0;
-		i = 0;
-		do {
-			char temp_char;
-			if (g.debug) fprintf(stderr,".");
-			bytes_read = read(g.serial_params.fd, &temp_char, 1);
-			if (bytes_read) {
-				d[i] = temp_char;
-				if (g.debug) { fprintf(stderr,"%02x ", d[i]); fflush(stdout); }
-
-				i++;
-
-				if (temp_char == 0x0A) {
-					end_of_frame_received = 1;
-					break;
+		if (SDL_WaitEventTimeout(&event, g->ui_event ? UI_IDLE_MS : UI_FRAME_MS)) {
+			do {
+				switch (event.type)
+				{
+					case SDL_KEYDOWN:
+						if (event.key.keysym.sym == SDLK_q) g->quit = true;
+						if (g->show_graph && ((event.key.keysym.sym == SDLK_UP) || (event.key.keysym.sym == SDLK_DOWN))) {
+							for (i = 0; i < g->meter_count; i++) trend_zoom(&tiles[i].trend, l.tile_width, event.key.keysym.sym == SDLK_UP);
+							redraw = true;
+						}
+						break;
+					case SDL_MOUSEBUTTONDOWN:
+						/*
+						 * With -r, clicking a meter's tile presses its
+						 * RANGE button, for any mode.  Without it a
+						 * click (to focus the window, say) must never
+						 * change the range mid-measurement.
+						 */
+						if (!g->range_control) break;
+						i = event.button.y / l.tile_height;
+						if ((i >= 0) && (i < g->meter_count)) meter_command(&g->meters[i], METER_CMD_RANGE, 0);
+						break;
+					case SDL_QUIT:
+						g->quit = true;
+						break;
+					case SDL_WINDOWEVENT:
+						/*
+						 * Nothing is drawn while nobody can see it,
+						 * readings still come off the queues
+						 */
+						switch (event.window.event) {
+							case SDL_WINDOWEVENT_HIDDEN:
+							case SDL_WINDOWEVENT_MINIMIZED:
+								visible = false;
+								break;
+							case SDL_WINDOWEVENT_SIZE_CHANGED:
+								window_layout(g, &l, event.window.data1, event.window.data2);
+								redraw = true;
+								break;
+							case SDL_WINDOWEVENT_SHOWN:
+							case SDL_WINDOWEVENT_RESTORED:
+							case SDL_WINDOWEVENT_MAXIMIZED:
+							case SDL_WINDOWEVENT_EXPOSED:
+								visible = true;
+								redraw = true;
+								break;
+						}
+						break;
+					default:
+						if (g->ui_event && (event.type == g->ui_event)) g->ui_woken = false; // before the queues are looked at, so nothing is missed
+						break;
 				}
-			}
-		} while ((bytes_read > 0) && (i < sizeof(d)) && (!end_of_frame_received));
+			} while (SDL_PollEvent(&event));
+		}
 
-		if (g.debug) { fprintf(stderr,":END [%d bytes]\r\n", i); fflush(stderr); }
+		if (stats.dump_requested.exchange(false)) stats_dump(stderr);
 
 		/*
-		 * Validate the received data
+		 * Only the newest reading from each meter matters for
+		 * the digits, but the graph wants every one of them.
+		 * If nothing new has arrived (and we don't need to
+		 * repaint the old ones) just wait for the next event.
 		 *
 		 */
-		usleep(INTERFRAME_SLEEP);
+		for (i = 0; i < g->meter_count; i++) {
+			struct tile_s *t = &tiles[i];
+			struct reading_s r;
 
-		/*
-		 * We should have received our command back as the first byte
-		 *
-		 */
-		if (d[0] != 0x89) continue;
+			if (!g->show_graph) {
+				if (g->meters[i].readings.pop_latest(t->r)) t->have_reading = changed = true;
+				continue;
+			}
 
-		/*
-		 * Validate our frame size
-		 *
-		 */
-		if (i != DATA_FRAME_SIZE) {
-			if (dt_loaded) memcpy(d, dt, sizeof(d));
-		} else {
-			memcpy(dt, d, sizeof(d)); // make a copy.
-			dt_loaded = 1;
+			while (g->meters[i].readings.pop(r)) {
+				if (!(r.s.flags & SAMPLE_FLAG_STALE)) {
+					if (t->have_reading && (r.s.mode != t->r.s.mode)) trend_clear(&t->trend); // different units, start again
+					trend_add(&t->trend, r.s.value);
+				}
+				t->r = r;
+				t->have_reading = changed = true;
+			}
 		}
+		if (changed && g->show_graph) redraw = true;
+		if (!changed && !redraw) continue;
 
+		for (i = 0; i < g->meter_count; i++) {
+			struct tile_s *t = &tiles[i];
 
-		//		continue;
+			value[i][0] = line2[i][0] = '\0';
+			stats_text[i][0][0] = stats_text[i][1][0] = '\0';
+			if (!t->have_reading) continue;
 
-		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
-		 *
-		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+			reading_text(g, &t->r, value[i], sizeof(value[i]));
+			if (g->meter_count == 1) snprintf(line2[i], sizeof(line2[i]), "%s %.1f/s", sample_mode_name(&t->r.s), t->r.rate);
+			else snprintf(line2[i], sizeof(line2[i]), "%d: %s %.1f/s", i +1, sample_mode_name(&t->r.s), t->r.rate);
+			//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
 
-		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
-		 * linetmp : contains the value we want show
-		 * mmode   : contains the meter mode (resistance, volts, amps etc)
-		 *  L"\u00B0C" = 'C
-		 *  L"\u00B0F" = 'F
-		 *  L"\u2126"  = ohms char
-		 *  L"\u00B5"  = mu char (micro)
-		 *
-		 */
+			if (g->stats_windows) {
+				runstats_format(&t->r.rs, 0, stats_text[i][0], sizeof(stats_text[i][0]));
+				runstats_format(&t->r.rs, 1, stats_text[i][1], sizeof(stats_text[i][1]));
+			}
 
-		range = d[2] & 0x38; // bits 3:5 of byte 2 are the range, meaning varies on mode
-		switch (range) {
-			case 0x00: dpp = 1; break;
-			case 0x08: dpp = 2; break;
-			case 0x10: dpp = 3; break;
-			case 0x18: dpp = 4; break;
-			case 0x20: dpp = 5; break;
-			case 0x28: dpp = 6; break;
+			if (strcmp(value[i], t->shown_value) || (g->show_mode && strcmp(line2[i], t->shown_line2))) redraw = true;
+			if (strcmp(stats_text[i][0], t->shown_stats[0]) || strcmp(stats_text[i][1], t->shown_stats[1])) redraw = true;
 		}
 
-		if (g.debug) fprintf(stderr,"Range %02x => DPP=%d\r\n", range, dpp);
-
-		snprintf(mmmode, sizeof(mmmode),"---");
-		switch (d[1] & 0b11111000) {
-			case 0xA0: snprintf(mmmode,sizeof(mmmode),"Generator"); break;
-			case 0xD0: snprintf(mmmode,sizeof(mmmode),"Frequency");
-						  snprintf(units,sizeof(units),"Hz");
-						  break;
-
-			case 0xC8: snprintf(mmmode,sizeof(mmmode),"Capacitance"); 
-						  if (g.units_separator) { units_override = true; }
-
-						  snprintf(units, sizeof(units), "F"); 
-						  if (dpp < 4)  {
-							  snprintf(prefix, sizeof(prefix), "n");
-							  dpp -= 1;
-						  } else {
-							  snprintf(prefix, sizeof(prefix), "%s",uu);
-							  dpp -= 4;
-						  }
-						  break;
-
-			case 0xC0: snprintf(mmmode,sizeof(mmmode),"Temperature");
-						  snprintf(units, sizeof(units),"%sC", dd);
-						  break;
-
-			case 0xD8: snprintf(mmmode,sizeof(mmmode),"Diode"); 
-						  if (g.units_separator) units_override = true;
-						  snprintf(units, sizeof(units), (units_override?"v":"V"));
-						  dpp -= 1;
-
-						  break;
-
-			case 0xE0: snprintf(mmmode,sizeof(mmmode),"Resistance");  
-						  snprintf(units, sizeof(units), "%s", oo);
-						  if (g.units_separator) {
-							  units_override = true;
-							  snprintf(units, sizeof(units), "");
-						  }
-
-						  switch (dpp) {
-							  case 1:
-								  snprintf(prefix, sizeof(prefix)," ");
-								  if (g.units_separator) { snprintf(prefix, sizeof(prefix),"%s",oo); }
-								  dpp+=1;
-								  break;
-
-							  case 5: 
-							  case 6:
-								  snprintf(prefix, sizeof(prefix),"M");
-								  dpp -= 5;
-								  break;
-
-							  default:
-								  snprintf(prefix, sizeof(prefix),"k");
-								  dpp -= 2;
-						  }
-
-						  break;
-
-			case 0xA8: snprintf(mmmode,sizeof(mmmode),"Current"); 
-						  snprintf(units, sizeof(units), "A");
-						  dpp -= 1;
-						  break;
-
-			case 0xB0: snprintf(mmmode,sizeof(mmmode),"Current");
-						  snprintf(units, sizeof(units), "mA");
-						  break;
-
-			case 0xE8: snprintf(mmmode,sizeof(mmmode),"Volts (mV)");
-						  snprintf(units, sizeof(units), "mV");
-						  break;
-
-			case 0xF8: snprintf(mmmode,sizeof(mmmode),"VAC");
-						  if (g.units_separator) units_override = true;
-						  snprintf(units, sizeof(units), (units_override?"v":"V"));
-						  dpp -= 1;
-						  break;
-
-			case 0xF0: snprintf(mmmode,sizeof(mmmode),"VDC"); 
-						  if (g.range_control) {
-							  if (d[2] & MMFLAG_AUTORANGE) {
-								  uint8_t b;
-								  cmd_send(&g, 0xA1);
-								  b = byte_read(&g);
-								  usleep(100000);
-								  cmd_send(&g, 0xA1);
-								  b = byte_read(&g);
-							  }
-						  }
-						  dpp -= 1;
-						  if (g.units_separator) units_override = true;
-						  snprintf(units, sizeof(units), (units_override?"v":"V"));
-						  break;
-
-			default:
-						  snprintf(mmmode, sizeof(mmmode), "***");
-						  snprintf(units, sizeof(units),"*");
-						  break;
+		if (!g->quiet && tiles[0].have_reading) {
+			fprintf(stdout,"%-40s\r", value[0]);
+			fflush(stdout);
 		}
 
+		/*
+		 * Only repaint when what's on screen would actually
+		 * change, or the window system lost our contents, and
+		 * only if it can be seen.  Presenting waits for vsync,
+		 * so readings faster than the display are drawn at the
+		 * display's rate and no faster.
+		 *
+		 */
+		if (redraw && visible) {
+			uint64_t t0 = stats_now_ns(), t1;
 
-		{
-			char sign_char = ' ';
-			char value[128];
-			char local_separator[10];
-			char *separator = SEPARATOR_DP;
-			int dp = 0;
-
-			sign_char='*';
-			switch (d[4] & 0b01110000) {
-				case 0:
-				case 0x40: sign_char = ' '; break;
-				case 0x50: sign_char = '-'; break;
+			/*
+			 * A size that can't be rasterised (too big for a
+			 * texture, say) keeps the last one.  It's asked for
+			 * again so it stays the most recently used, and
+			 * failed sizes can never push it out of the cache.
+			 */
+			if (l.font_size != atlas_size) {
+				struct atlas_s *a = atlas_cache_get(&atlases, renderer, l.font_size);
+				struct atlas_s *a_small = atlas_cache_get(&atlases, renderer, l.font_size / 4);
+
+				if (a && a_small) {
+					atlas = a;
+					atlas_small = a_small;
+					atlas_size = l.font_size;
+				} else {
+					fprintf(stderr,"%s:%d: Unable to draw at %dpt, staying at %dpt\r\n", FL, l.font_size, atlas_size);
+					l.font_size = atlas_size;
+					atlas = atlas_cache_get(&atlases, renderer, atlas_size);
+					atlas_small = atlas_cache_get(&atlases, renderer, atlas_size / 4);
+				}
 			}
 
-			if (g.units_separator) {
-				if (prefix[0]==' ') prefix[0] = '\0';
-				snprintf(local_separator, sizeof(local_separator), "%s%s", prefix, units);
-				separator = local_separator;
-			}
+			SDL_RenderClear(renderer);
+			for (i = 0; i < g->meter_count; i++) {
+				struct tile_s *t = &tiles[i];
+				int y = i * l.tile_height;
+
+				atlas_draw(atlas, renderer, value[i], 0, y);
+				if (g->show_mode) atlas_draw(atlas_small, renderer, line2[i], 0, y);
+				if (g->stats_windows) {
+					atlas_draw(atlas_small, renderer, stats_text[i][0], 0, y + l.text_height - 2 * atlas_small->height);
+					atlas_draw(atlas_small, renderer, stats_text[i][1], 0, y + l.text_height - atlas_small->height);
+				}
+				if (g->show_graph) {
+					SDL_SetRenderDrawColor(renderer, g->font_color.r, g->font_color.g, g->font_color.b, 255);
+					trend_draw(&t->trend, renderer, 0, y + l.text_height, l.tile_width, l.tile_height - l.text_height);
+					SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255);
+				}
 
-			snprintf(linetmp, sizeof(linetmp), "%c%c%s%c%s%c%s%c%s%c%s%s"
-					,sign_char
-					,digit(d[5])
-					,dpp==0?separator:""
-					,digit(d[6])
-					,dpp==1?separator:""
-					,digit(d[7])
-					,dpp==2?separator:""
-					,digit(d[8])
-					,dpp==3?separator:""
-					,digit(d[9])
-					,g.units_separator?"":prefix
-					,g.units_separator?"":units
-					);
-
-			if (g.units_separator) {
-				char *p = linetmp+1; // skip the sign char
-				while (*p == '0') { *p = ' '; p++; }
-				if (!isdigit(*p)) *(p-1) = '0';
+				snprintf(t->shown_value, sizeof(t->shown_value), "%s", value[i]);
+				snprintf(t->shown_line2, sizeof(t->shown_line2), "%s", line2[i]);
+				snprintf(t->shown_stats[0], sizeof(t->shown_stats[0]), "%s", stats_text[i][0]);
+				snprintf(t->shown_stats[1], sizeof(t->shown_stats[1]), "%s", stats_text[i][1]);
 			}
+			t1 = stats_now_ns();
+			SDL_RenderPresent(renderer);
+			stats_record(STAGE_RENDER, t1 - t0);
+			stats_record(STAGE_PRESENT, stats_now_ns() - t1);
+			redraw = false;
 		}
 
-		/*
-		 *
-		 * END OF DECODIN9
-		 */
+	} // while(1)
+	result = 0;
 
+	/*
+	 * Normal exit or not, the acquisition thread is still going
+	 * and SDL is about to stop; no new events, and wait out any
+	 * post in progress
+	 */
+done:
+	g->ui_event = 0;
+	while (g->ui_posting) usleep(100);
+
+	for (i = 0; i < g->meter_count; i++) trend_free(&tiles[i].trend);
+	atlas_cache_free(&atlases);
+	if (renderer) SDL_DestroyRenderer(renderer);
+	if (window) SDL_DestroyWindow(window);
+	TTF_Quit();
+	SDL_Quit();
 
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
+	return result;
+}
 
-		if (!g.quiet) fprintf(stdout,"%s\r",line1); fflush(stdout);
 
-		{
-			int texW = 0;
-			int texH = 0;
-			int texW2 = 0;
-			int texH2 = 0;
-			SDL_RenderClear(renderer);
-			surface = TTF_RenderUTF8_Solid(font, line1, g.font_color);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = { 0, 0, texW, texH };
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-
-			if (g.show_mode) {
-				surface_2 = TTF_RenderUTF8_Solid(font_small, line2, g.font_color);
-				texture_2 = SDL_CreateTextureFromSurface(renderer, surface_2);
-				SDL_QueryTexture(texture_2, NULL, NULL, &texW2, &texH2);
-				dstrect = { 0, 0, texW2, texH2 };
-				SDL_RenderCopy(renderer, texture_2, NULL, &dstrect);
-			}
+/*-----------------------------------------------------------------\
+  Date Code:	: 20180127-220307
+  Function Name	: main
+  Returns Type	: int
+  ----Parameter List
+  1. int argc,
+  2.  char **argv ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
 
-			SDL_RenderPresent(renderer);
+--------------------------------------------------------------------
+Changes:
 
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-			if (g.show_mode) {
-				SDL_DestroyTexture(texture_2);
-				SDL_FreeSurface(surface_2);
-			}
+\------------------------------------------------------------------*/
+int main ( int argc, char **argv ) {
 
+	struct glb g;        // Global structure for passing variables around
+	pthread_t acquire_tid;
+	int result;
+	int err;
+	int i;
 
+	glbs = &g;
 
-		}
+	/*
+	 * Initialise the global structure
+	 */
+	init(&g);
 
+	/*
+	 * Parse our command line parameters
+	 */
+	parse_parameters(&g, argc, argv);
 
-		if (g.output_file) {
-			/*
-			 * Only write the file out if it doesn't
-			 * exist. 
-			 *
-			 */
-			if (!fileExists(g.output_file)) {
-				FILE *f;
-				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g.output_file);
-				f = fopen(tfn,"w");
-				if (f) {
-					fprintf(f,"%s", linetmp);
-					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, tfn);
-					fclose(f);
-					rename(tfn, g.output_file);
-				}
-			}
+	signal(SIGINT, quit_handler);
+	signal(SIGTERM, quit_handler);
+	signal(SIGUSR1, stats_handler);
+	signal(SIGUSR2, wire_handler);
+
+	if (g.debug && trace_start(stderr)) exit(1);
+	if (wire_start(g.wire_spec)) exit(1);
+
+	/*
+	 * Handle the COM Port(s)
+	 */
+	if ((g.meter_count == 0) && FAKE_SERIAL) g.meters[g.meter_count++].device = (char *)"sim";
+	if (g.meter_count == 0) {
+		fprintf(stdout,"No com port given; -p <com port>\n");
+		exit(1);
+	}
+	for (i = 0; i < g.meter_count; i++) {
+		struct meter_s *m = &g.meters[i];
+
+		m->index = i;
+		m->debug = g.debug;
+		m->range_control = g.range_control;
+		m->low_latency = g.low_latency;
+		m->serial_params.fd = -1;
+		if ((g.stats_windows && runstats_init(&m->runstats, g.stats_windows)) || meter_open(m, g.sample_rate)) {
+			while (i--) meter_close(&g.meters[i]); // stop any simulators already going
+			exit(1);
 		}
+	}
 
-	} // while(1)
+	if (g.log_file && samplelog_open(&g.samplelog, g.log_file)) exit(1);
+	if (g.archive_file && archive_start(&g.archive, g.archive_file)) exit(1);
+	if (g.output_file && output_start(&g.output, g.output_file, g.units_separator, g.debug, g.stats_windows != NULL)) exit(1);
+	if (g.server_address && server_start(&g.server, g.server_address)) exit(1);
+	if (g.metrics_address && metrics_start(&g.metrics, g.metrics_address)) exit(1);
+	if (g.trigger_spec && trigger_start(&g.trigger, g.trigger_spec, g.meter_count)) exit(1);
+
+	/*
+	 * Start the meter side running before anything else,
+	 * the display can catch up once it's ready.
+	 *
+	 */
+	err = pthread_create(&acquire_tid, NULL, acquire_thread, &g);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start acquisition thread (%s)\r\n", FL, strerror(err));
+		exit(1);
+	}
 
-	if (g.serial_params.fd) close(g.serial_params.fd);
+	if (g.headless) result = run_headless(&g);
+	else result = run_window(&g);
 
-	TTF_CloseFont(font);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	TTF_Quit();
-	SDL_Quit();
+	g.quit = true;
+	pthread_join(acquire_tid, NULL);
 
-	return 0;
+	if (g.log_file) samplelog_close(&g.samplelog);
+	if (g.archive_file) archive_stop(&g.archive);
+	if (g.output_file) output_stop(&g.output);
+	if (g.server_address) server_stop(&g.server);
+	if (g.metrics_address) metrics_stop(&g.metrics);
+	if (g.trigger_spec) trigger_stop(&g.trigger);
+
+	for (i = 0; i < g.meter_count; i++) meter_close(&g.meters[i]);
+	wire_stop();
+	trace_stop();
+
+	if (!g.quiet) stats_dump(stderr);
+
+	return result;
 
 }
@@ -0,0 +1,337 @@
+/*
+ * Wire capture
+ *
+ * One writer thread for every meter's ring; a dump copies the
+ * ring out as it stands and queues it, so the acquisition thread
+ * never waits on the file.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spsc.h"
+#include "stats.h"
+#include "wire.h"
+
+#define FL __FILE__,__LINE__
+
+static struct {
+	char prefix[4000];
+	uint64_t span_ns;  // of a dump
+	size_t ring_size;  // bytes per meter, a power of two
+	bool on_error;     // -W given, dump on frame errors too
+	std::atomic<uint32_t> requests; // SIGUSR2s so far
+	spsc_ring<struct wire_s *, WIRE_QUEUE> queue;
+	sem_t ready;
+	std::atomic<bool> quit;
+	bool running;
+	int file_index;
+	pthread_t tid;
+} wr;
+
+static void wire_put( struct wire_s *w, const void *data, size_t len ) {
+	const uint8_t *p = (const uint8_t *)data;
+	size_t i;
+
+	for (i = 0; i < len; i++) w->ring[(w->head +i) & (wr.ring_size -1)] = p[i];
+	w->head += len;
+}
+
+static void wire_get( struct wire_s *w, size_t at, void *data, size_t len ) {
+	uint8_t *p = (uint8_t *)data;
+	size_t i;
+
+	for (i = 0; i < len; i++) p[i] = w->ring[(at +i) & (wr.ring_size -1)];
+}
+
+/*
+ * Save one dump, starting from the first chunk inside the span,
+ * in the next <prefix>-<meter>-<n>.vcap that doesn't already exist
+ *
+ */
+static void wire_write( struct wire_s *w ) {
+	struct capture_header_s h;
+	struct capture_chunk_s c = { 0, 0, 0 };
+	struct timespec rt, mt;
+	size_t at = 0;
+	uint64_t now_ns;
+	char fn[4096];
+	FILE *f;
+
+	while (at + sizeof(c) <= w->out_len) {
+		memcpy(&c, w->out +at, sizeof(c));
+		if (c.t_ns >= w->out_from_ns) break;
+		at += sizeof(c) + c.len;
+	}
+	if (at + sizeof(c) > w->out_len) {
+		fprintf(stderr,"Wire capture: nothing from meter %d to save\r\n", w->index);
+		return;
+	}
+
+	do {
+		snprintf(fn, sizeof(fn), "%s-%d-%03d.vcap", wr.prefix, w->index, ++wr.file_index);
+	} while (access(fn, F_OK) == 0);
+
+	f = fopen(fn, "wbx");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to create wire capture '%s' (%s)\r\n", FL, fn, strerror(errno));
+		return;
+	}
+
+	/*
+	 * The header's start is the first chunk kept, put on the
+	 * wall clock by way of how long ago that was
+	 */
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	now_ns = (uint64_t)mt.tv_sec * 1000000000 + mt.tv_nsec;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+	h.version = CAPTURE_VERSION;
+	h.baud = 9600;
+	h.start_mono_ns = c.t_ns;
+	h.start_realtime_ns = (uint64_t)rt.tv_sec * 1000000000 + rt.tv_nsec - (now_ns - c.t_ns);
+
+	if ((fwrite(&h, sizeof(h), 1, f) != 1) || (fwrite(w->out +at, 1, w->out_len - at, f) != w->out_len - at)) {
+		fprintf(stderr,"%s:%d: Unable to write wire capture '%s' (%s)\r\n", FL, fn, strerror(errno));
+	}
+	fclose(f);
+
+	stats_count(COUNT_WIRE_DUMPS, 1);
+	fprintf(stderr,"Wire capture: %.1fs from meter %d saved to '%s'\r\n", (now_ns - c.t_ns) / 1e9, w->index, fn);
+}
+
+static void *wire_thread( void * ) {
+	struct wire_s *w;
+
+	while (1) {
+		while ((sem_wait(&wr.ready) != 0) && (errno == EINTR)) { /* signal, wait again */ }
+
+		while (wr.queue.pop(w)) {
+			wire_write(w);
+			w->out_busy = false;
+		}
+		if (wr.quit) break;
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: wire_start
+  Returns Type	: int
+  ----Parameter List
+  1. const char *spec, the -W argument, <prefix>[,<seconds>], or NULL
+  ------------------
+  Exit Codes	: 0 on success, -1 on failure
+  Side Effects	: starts the writer thread
+  --------------------------------------------------------------------
+Comments:
+	Always called, capture runs whether or not -W was given;
+	-W only says where dumps go and adds the frame error ones.
+
+\------------------------------------------------------------------*/
+int wire_start( const char *spec ) {
+	double seconds = WIRE_SECONDS;
+	const char *comma;
+	int err;
+
+	snprintf(wr.prefix, sizeof(wr.prefix), "%s", WIRE_PREFIX);
+	wr.on_error = (spec != NULL);
+	if (spec) {
+		comma = strchr(spec, ',');
+		if (comma) {
+			char *end;
+
+			seconds = strtod(comma +1, &end);
+			if ((end == comma +1) || *end || (seconds <= 0)) {
+				fprintf(stderr,"%s:%d: Bad wire capture '%s', expecting <prefix>[,<seconds>]\r\n", FL, spec);
+				return -1;
+			}
+			snprintf(wr.prefix, sizeof(wr.prefix), "%.*s", (int)(comma - spec), spec);
+		} else {
+			snprintf(wr.prefix, sizeof(wr.prefix), "%s", spec);
+		}
+	}
+	wr.span_ns = (uint64_t)(seconds * 1e9);
+
+	/*
+	 * Enough ring for the span with the meter polled flat out,
+	 * rounded up to a power of two for the masking
+	 */
+	wr.ring_size = WIRE_RING_MIN;
+	while ((wr.ring_size < WIRE_RING_MAX) && (wr.ring_size < seconds * WIRE_BYTES_PER_S)) wr.ring_size *= 2;
+	if (seconds * WIRE_BYTES_PER_S > WIRE_RING_MAX) {
+		fprintf(stderr,"Wire capture: %gs won't fit in a %dMB ring, dumps will hold about %ds\r\n"
+				, seconds, WIRE_RING_MAX / (1024 * 1024), WIRE_RING_MAX / WIRE_BYTES_PER_S);
+	}
+
+	wr.file_index = 0;
+	wr.quit = false;
+
+	sem_init(&wr.ready, 0, 0);
+	err = pthread_create(&wr.tid, NULL, wire_thread, NULL);
+	if (err != 0) {
+		fprintf(stderr,"%s:%d: Unable to start wire capture thread (%s)\r\n", FL, strerror(err));
+		return -1;
+	}
+	wr.running = true;
+
+	return 0;
+}
+
+/*
+ * Write out anything still queued and stop the thread
+ *
+ */
+void wire_stop( void ) {
+	if (!wr.running) return;
+
+	wr.quit = true;
+	sem_post(&wr.ready);
+	pthread_join(wr.tid, NULL);
+	wr.running = false;
+}
+
+/*
+ * SIGUSR2; just a counter, each meter notices it has
+ * fallen behind next time wire_poll() looks
+ *
+ */
+void wire_request_dump( void ) {
+	wr.requests.fetch_add(1);
+}
+
+int wire_open( struct wire_s *w, int index ) {
+	w->index = index;
+	w->ring = (uint8_t *)malloc(wr.ring_size);
+	w->out = (uint8_t *)malloc(wr.ring_size);
+	if (!w->ring || !w->out) {
+		fprintf(stderr,"%s:%d: Unable to allocate wire capture ring\r\n", FL);
+		free(w->ring);
+		free(w->out);
+		w->ring = w->out = NULL;
+		return -1;
+	}
+	w->head = w->tail = 0;
+	w->requests_seen = wr.requests.load();
+	w->error_dump_ns = 0;
+	w->holdoff_ns = 0;
+	w->out_len = 0;
+	w->out_busy = false;
+
+	return 0;
+}
+
+void wire_close( struct wire_s *w ) {
+	if (!w->ring) return;
+
+	while (w->out_busy) usleep(1000); // writer still has it
+
+	free(w->ring);
+	free(w->out);
+	w->ring = w->out = NULL;
+}
+
+/*
+ * Bytes that just went over the wire; timestamped now, split
+ * in to chunks of at most 255, oldest chunks making way
+ *
+ */
+void wire_add( struct wire_s *w, int dir, const uint8_t *data, size_t len ) {
+	struct capture_chunk_s c;
+
+	if (!w->ring) return;
+
+	c.t_ns = stats_now_ns();
+	c.dir = dir;
+
+	while (len) {
+		c.len = (len > 255) ? 255 : len;
+
+		while (w->head - w->tail + sizeof(c) + c.len > wr.ring_size) {
+			struct capture_chunk_s old;
+
+			wire_get(w, w->tail, &old, sizeof(old));
+			w->tail += sizeof(old) + old.len;
+		}
+
+		wire_put(w, &c, sizeof(c));
+		wire_put(w, data, c.len);
+		data += c.len;
+		len -= c.len;
+	}
+}
+
+/*
+ * Copy the ring for the writer.  If it's still busy with the
+ * last one, this one is counted and lost.
+ *
+ */
+static void wire_dump( struct wire_s *w ) {
+	size_t used = w->head - w->tail;
+	size_t offset = w->tail & (wr.ring_size -1);
+	size_t run = wr.ring_size - offset;
+	uint64_t now_ns = stats_now_ns();
+
+	if (w->out_busy) {
+		stats_count(COUNT_WIRE_DUMPS_MISSED, 1);
+		return;
+	}
+
+	if (run > used) run = used;
+	memcpy(w->out, w->ring +offset, run);
+	memcpy(w->out +run, w->ring, used - run);
+	w->out_len = used;
+	w->out_from_ns = (now_ns > wr.span_ns) ? now_ns - wr.span_ns : 0;
+
+	w->out_busy = true;
+	wr.queue.push(w);
+	sem_post(&wr.ready);
+}
+
+/*
+ * A frame was rejected, or the reply was short or never came;
+ * dump once a little more has come in, so the capture shows
+ * what the meter did next as well
+ *
+ */
+void wire_error( struct wire_s *w ) {
+	uint64_t now_ns;
+
+	if (!wr.on_error || w->error_dump_ns) return;
+
+	now_ns = stats_now_ns();
+	if (now_ns < w->holdoff_ns) return;
+
+	w->error_dump_ns = now_ns + (uint64_t)WIRE_POST_MS * 1000000;
+	w->holdoff_ns = now_ns + (uint64_t)WIRE_HOLDOFF_S * 1000000000;
+}
+
+/*
+ * Acquisition thread, every time round its loop
+ *
+ */
+void wire_poll( struct wire_s *w ) {
+	uint32_t requests = wr.requests.load(std::memory_order_relaxed);
+
+	if (!w->ring) return;
+
+	if (requests != w->requests_seen) {
+		w->requests_seen = requests;
+		wire_dump(w);
+	}
+
+	if (w->error_dump_ns && (stats_now_ns() >= w->error_dump_ns)) {
+		w->error_dump_ns = 0;
+		wire_dump(w);
+	}
+}
@@ -0,0 +1,77 @@
+/*
+ * Wire capture
+ *
+ * Every byte sent to and read from each meter goes in to a
+ * ring as capture chunks (see capture.h), whether or not -d
+ * is on, so when a meter misbehaves the exact byte stream leading
+ * up to it is still there; junk, short replies and all.
+ *
+ * The ring is dumped as a capture file, playable with -p replay:,
+ *
+ *   on SIGUSR2, for every meter
+ *   on a frame error or a reply timeout, with -W, once
+ *   WIRE_POST_MS more has been captured and at most once every
+ *   WIRE_HOLDOFF_S per meter
+ *
+ * Dumps hold the last -W seconds (WIRE_SECONDS by default) and go
+ * in <prefix>-<meter>-<n>.vcap.  The ring is sized for that many
+ * seconds of a meter polled flat out, WIRE_BYTES_PER_S, chunk
+ * headers and all; up to WIRE_RING_MAX, beyond which dumps come
+ * out shorter than asked (and we say so at startup).  The
+ * acquisition thread only ever copies the ring, the file is
+ * written on a thread of its own.
+ *
+ */
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+#define WIRE_BYTES_PER_S 8192 // ring bytes a second at 9600 baud, a chunk header on every read and request
+#define WIRE_RING_MIN (64 * 1024)
+#define WIRE_RING_MAX (64 * 1024 * 1024) // per meter
+#define WIRE_SECONDS 30      // default span of a dump
+#define WIRE_POST_MS 250     // after a frame error, keep capturing this long before dumping
+#define WIRE_HOLDOFF_S 60    // frame error dumps per meter at most this often
+#define WIRE_PREFIX "vc8145-wire" // SIGUSR2 dumps without -W
+#define WIRE_QUEUE 16        // acquisition -> writer, must be a power of two
+
+struct wire_s {
+	int index;
+
+	/*
+	 * capture_chunk_s + data, back to back; head/tail run
+	 * freely and are masked on access.  Acquisition thread only.
+	 */
+	uint8_t *ring;
+	size_t head, tail;
+
+	uint32_t requests_seen; // SIGUSR2 dumps already done
+	uint64_t error_dump_ns; // a frame error dump is due then, 0 = none
+	uint64_t holdoff_ns;    // no frame error dumps before this
+
+	/*
+	 * Ring copy on its way to the writer thread, which
+	 * clears out_busy once it's in the file
+	 */
+	uint8_t *out;
+	size_t out_len;
+	uint64_t out_from_ns; // chunks before this are left out
+	std::atomic<bool> out_busy;
+};
+
+int wire_start( const char *spec );
+void wire_stop( void );
+void wire_request_dump( void );
+
+int wire_open( struct wire_s *w, int index );
+void wire_close( struct wire_s *w );
+void wire_add( struct wire_s *w, int dir, const uint8_t *data, size_t len );
+void wire_error( struct wire_s *w );
+void wire_poll( struct wire_s *w );
+
+#endif